@@ -3,8 +3,12 @@
 
 #include <vector>
 #include <set>
+#include <memory>
+#include <cstdint>
 #include "utils.h"
 
+struct RunContext;
+
 // if the target needs to be scaled (into [-1,1]) before training, we store
 // everything in this struct, that is required to invert the scaling after training 
 struct Scaler {
@@ -16,18 +20,51 @@ struct Scaler {
     Scaler(double min_val, double max_val, double fmin, double fmax, bool scaling_required);
 };
 
+// X, stored column by column, each in the smallest type that fits:
+//  - NUMERICAL: raw feature values (feature_t)
+//  - CATEGORICAL8/16: label-encoded categories as uint8/uint16 codes
+//  - BINNED8/16: numerical features mapped to bin codes (see bin()).
+//    bin b holds the values in [values[f][b], values[f][b+1])
+// kind[f] tells in which vector feature f lives, index[f] at which position.
+// values[f][code] translates a code back into the units of the original X.
+struct FeatureMatrix {
+    enum Kind { NUMERICAL, CATEGORICAL8, CATEGORICAL16, BINNED8, BINNED16 };
+
+    // constructors
+    FeatureMatrix() {};
+    FeatureMatrix(const VVF &rows, const std::vector<int> &cat_idx);
+
+    // fields
+    std::vector<Kind> kind;
+    std::vector<int> index;
+    std::vector<std::vector<feature_t>> numerical;
+    std::vector<std::vector<uint8_t>> codes8;
+    std::vector<std::vector<uint16_t>> codes16;
+    std::vector<std::vector<double>> values;
+    double bin_privacy_budget = 0;  // spent on the bin edges (bin())
+
+    // methods
+    size_t num_cols() const { return kind.size(); }
+    bool is_categorical(int feature) const { return kind[feature] == CATEGORICAL8 or kind[feature] == CATEGORICAL16; }
+    double value(int row, int feature) const;
+    double code_value(int feature, double code) const;
+    void swap_rows(int i, int j);
+    FeatureMatrix gather_rows(const std::vector<int> &rows) const;
+    void bin(int max_bins, double percentile, double budget, RunContext &context);
+};
+
 // basic wrapper around our data:
-//  - matrix X
+//  - matrix X (stored column-wise, see FeatureMatrix)
 //  - target y
 //  - vector for the samples' gradients (which get constantly updated)
 //  - some useful attributes
 struct DataSet {
     // constructors
     DataSet();
-    DataSet(VVD X, std::vector<double> y);
+    DataSet(const VVF &X, std::vector<double> y, const std::vector<int> &cat_idx = {});
 
     // fields
-    VVD X;
+    FeatureMatrix X;
     std::vector<double> y;
     std::vector<double> gradients;
     int length, num_x_cols;
@@ -36,26 +73,37 @@ struct DataSet {
     std::string name;
 
     // methods
-    void add_row(std::vector<double> xrow, double yval);
     void scale_y(ModelParams &params, double lower, double upper);
     void shuffle_dataset();
-    DataSet get_subset(std::vector<int> &indices);
-    DataSet remove_rows(std::vector<int> &indices);
 };
 
-// wrapper around 2 DataSets that belong together
+// one cv fold, as an index range into a shared (shuffled, read-only) DataSet:
+//      [ train.. | test | ..train ]
+// no rows get copied, so all folds can be trained concurrently on the same data
+// (binned features too, the dataset is binned once for all of them).
 struct TrainTestSplit {
-    DataSet train;
-    DataSet test;
-    TrainTestSplit(DataSet train, DataSet test) : train(train), test(test) {};
-    TrainTestSplit() {};
+    std::shared_ptr<const DataSet> dataset;
+    int test_begin, test_end;
+    Scaler scaler;
+    TrainTestSplit(std::shared_ptr<const DataSet> dataset, int test_begin, int test_end);
+
+    // methods
+    const FeatureMatrix &X() const { return dataset->X; }  // what to train/predict on
+    std::vector<int> train_indices() const;
+    std::vector<int> test_indices() const;
+    std::vector<double> train_y() const;
+    std::vector<double> test_y() const;
+    void scale_y(ModelParams &params, double lower, double upper);
 };
 
 
 // method declarations
 void inverse_scale_y(ModelParams &params, Scaler &scaler, std::vector<double> &vec);
-TrainTestSplit train_test_split_random(DataSet &dataset, double train_ratio = 0.70, bool shuffle = false);
-std::vector<TrainTestSplit *> create_cross_validation_inputs(DataSet *dataset, int folds);
+Scaler compute_scaler(ModelParams &params, std::vector<double> &y, double lower, double upper);
+void scale_y(const Scaler &scaler, std::vector<double> &vec);
+TrainTestSplit train_test_split_random(std::shared_ptr<DataSet> dataset, double train_ratio = 0.70, bool shuffle = false);
+std::vector<TrainTestSplit *> create_cross_validation_inputs(std::shared_ptr<DataSet> dataset, int folds,
+    bool shuffle = true);
 
 
 #endif /* DATA_H */
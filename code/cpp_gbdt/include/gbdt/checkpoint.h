@@ -0,0 +1,88 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "tree_node.h"
+
+
+/*
+    Training checkpoints (ModelParams::checkpoint). An append-only file: a
+    CheckpointHeader identifying the training run (its shape, plus hashes of
+    the parameters and of the train rows / labels), then one record per finished
+    round (native byte order):
+        uint64 size, payload (CheckpointRound), uint64 FNV-1a hash of the payload
+    A record that was cut off or damaged by a crash ends the file, resuming
+    starts after the last intact one.
+*/
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_outputs;   // K
+    uint64_t num_rows;      // train rows
+    int32_t nb_trees;       // rounds of this run
+    int32_t first_round;    // rounds that existed before (warm start)
+    uint64_t params_hash;   // of everything in ModelParams that shapes the trees
+    uint64_t data_hash;     // of the train rows (ids) and their labels
+};
+static_assert(sizeof(CheckpointHeader) == 48, "CheckpointHeader is written to files as is");
+
+CheckpointHeader make_checkpoint_header(uint32_t num_outputs, uint64_t num_rows, int nb_trees, int first_round,
+    uint64_t params_hash, uint64_t data_hash);
+
+// FNV-1a, pass the previous hash to continue it over several buffers
+uint64_t fnv1a(const char *data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL);
+
+// state after a finished round
+struct CheckpointRound {
+    int32_t round;
+    uint32_t seed;                              // seed of the run's random numbers for the next round
+    std::vector<std::vector<FlatNode>> trees;   // the round's K trees
+    std::vector<uint8_t> used_rows;             // bitmap over the train rows
+    std::vector<double> tree_sums;              // cached outputs of the unused rows (K blocks)
+    double best_valid_score;                    // early stopping
+    int32_t best_round;
+};
+
+// all complete rounds of the checkpoint at path (none if there's no file), only
+// the last one keeps its used_rows and tree_sums. valid_size is set to the length
+// of the file up to that round. Throws if the file belongs to a different run.
+std::vector<CheckpointRound> read_checkpoint(const std::string &path, const CheckpointHeader &header,
+    size_t &valid_size);
+
+
+// appends rounds to a checkpoint file on its own thread, write() only queues
+// the encoded round. Each round is on disk (fdatasync) before the next is written.
+class CheckpointWriter
+{
+public:
+    // constructors
+    CheckpointWriter(const std::string &path, const CheckpointHeader &header, size_t valid_size);
+    ~CheckpointWriter();
+    CheckpointWriter(const CheckpointWriter &) = delete;
+    CheckpointWriter &operator=(const CheckpointWriter &) = delete;
+
+    // methods
+    void write(const CheckpointRound &round);
+
+private:
+    // fields
+    std::string path;
+    int fd;
+    std::deque<std::vector<char>> queue;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+    std::string error;
+    std::thread thread;
+
+    // methods
+    void run();
+};
+
+#endif // CHECKPOINT_H
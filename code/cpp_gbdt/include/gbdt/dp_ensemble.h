@@ -3,33 +3,69 @@
 
 #include <vector>
 #include <fstream>
+#include <string>
 #include "dp_tree.h"
 #include "parameters.h"
 #include "data.h"
+#include "checkpoint.h"
+#include "run_context.h"
 
 
 class DPEnsemble
 {
 public:
     // constructors
-    DPEnsemble(ModelParams *params);
+    // the context (mode, random numbers, verification log) has to outlive the ensemble
+    DPEnsemble(ModelParams *params, RunContext *context);
     ~DPEnsemble();
 
     // fields
-    std::vector<DPTree> trees;
+    std::vector<DPTree> trees;      // multi-class: K per round, trees[round * K + class]
 
     // methods
-    void train(DataSet *dataset);
-    std::vector<double> predict(VVD &X);
+    void train(TrainTestSplit *split);
+    void train(const DataSet &dataset);
+    void train(const FeatureMatrix &train_X, const std::vector<int> &train_rows, const std::vector<double> &train_y);
+    std::vector<double> predict(const VVF &X);
+    std::vector<double> predict(const FeatureMatrix &X, const std::vector<int> &rows);
+    void set_validation(const FeatureMatrix &X, const std::vector<int> &rows, const std::vector<double> &y);
+
+    // persistence (see dp_ensemble.cpp for the file format)
+    void save(const std::string &path);
+    void load(const std::string &path);
+    void dump_json(std::ostream &out);
+    ModelParams *parameters() { return params; }    // after load() the ensemble's own copy
 
 private:
     // fields
     ModelParams *params;
-    DataSet *dataset;
-    double init_score;
+    ModelParams loaded_params;      // load(): the caller's params with the saved model's fields
+    RunContext *context;
+    const FeatureMatrix *features;
+    std::vector<int> rows;          // rows of features that weren't used by a tree yet
+    std::vector<double> y;          // their (scaled) targets
+    std::vector<double> gradients;  // and their gradients (K blocks, see Task)
+    std::vector<double> tree_sums;  // and the sum of the trees' outputs (K blocks)
+    std::vector<int> train_positions;   // checkpoints: position of the unused rows in the train rows
+
+    // early stopping
+    const FeatureMatrix *valid_X = nullptr;
+    std::vector<int> valid_rows;
+    std::vector<double> valid_y;
+    std::vector<double> valid_sums;  // sum of the trees' outputs on the validation rows (K blocks)
+    double best_valid_score;
+    int best_round;
+    std::vector<double> init_score; // one per class
 
     // methods
     void update_gradients(std::vector<double> &gradients, int tree_index);
+    void remove_rows(std::vector<int> &positions);
+    std::vector<double> tree_output_sums(const FeatureMatrix &X, const std::vector<int> &rows);
+    void apply_learning_rate(std::vector<double> &predictions);
+    void fit_trees(std::vector<DPTree> &round_trees, size_t num_rows);
+    bool check_early_stop(int tree_index);
+    void write_checkpoint(CheckpointWriter &checkpoint, int tree_index, size_t num_train_rows);
+    int resume(const std::vector<CheckpointRound> &rounds, int first_round);
 };
 
 #endif // DPTREEENSEMBLE_H
\ No newline at end of file
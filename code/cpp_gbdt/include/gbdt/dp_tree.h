@@ -8,6 +8,7 @@
 #include "parameters.h"
 #include "data.h"
 #include "utils.h"
+#include "run_context.h"
 
 
 // wrapper around attributes that represent one possible split
@@ -20,41 +21,93 @@ struct SplitCandidate {
 };
 
 
+// how a sample is sent left, chosen at compile time from the column's kind
+struct NumericalSplit {
+    template <typename T> static bool goes_left(T value, T split_value) { return value < split_value; }
+};
+struct CategoricalSplit {
+    template <typename T> static bool goes_left(T value, T split_value) { return value == split_value; }
+};
+
+
+// what a tree is built for, chosen once per tree (see DPTree::fit). The builder
+// is instantiated per policy, so the dp build has no verification rounding and
+// no non-dp branches, the non-dp build no privacy code, and so on.
+template <bool DP, bool VERIFICATION>
+struct BuildPolicy {
+    static constexpr bool use_dp = DP;
+    static constexpr bool verification = VERIFICATION;  // deterministic, rounded, logged
+};
+typedef BuildPolicy<true, false> DPBuild;
+typedef BuildPolicy<false, false> NonDPBuild;
+typedef BuildPolicy<true, true> VerificationBuild;
+typedef BuildPolicy<false, true> NonDPVerificationBuild;
+
+
 class DPTree
 {
 private:
     // fields
     ModelParams *params;
+    RunContext *context;
     TreeParams *tree_params;
-    DataSet *dataset;
+    const FeatureMatrix *features;          // the X this tree trains on
+    const std::vector<int> *rows;           // its rows this tree trains on
+    const std::vector<double> *gradients;   // their gradients (aligned with rows)
     size_t tree_index;
+    Random *random;                         // the tree's own random numbers, during fit()
     std::vector<TreeNode *> leaves;
 
-    // methods
+    // methods, the builder ones are templated on the BuildPolicy
+    template <typename Policy>
+    void build();
+    template <typename Policy>
     TreeNode *make_tree_DFS(int current_depth, std::vector<int> live_samples);
     TreeNode *make_leaf_node(int current_depth, std::vector<int> &live_samples);
-    double _predict(std::vector<double> *row, TreeNode *node);
-    TreeNode *find_best_split(VVD &X_live, std::vector<double> &gradients_live, int current_depth);
-    void samples_left_right_partition(std::vector<int> &lhs, VVD &samples,
-                int feature_index, double feature_value, bool categorical);
-    double compute_gain(VVD &samples, std::vector<double> &gradients_live, int feature_index,
-                double feature_value, int &lhs_size, bool categorical);
+    double _predict(const std::vector<feature_t> *row, TreeNode *node, const std::vector<bool> &categorical);
+    template <typename Policy>
+    TreeNode *find_best_split(std::vector<int> &live_samples, std::vector<double> &gradients_live,
+                int current_depth);
+    template <typename Policy>
+    void scan_feature(int feature_index, std::vector<int> &live_samples, std::vector<double> &gradients_live,
+                double privacy_budget_for_node, std::vector<SplitCandidate> &candidates);
+    std::vector<int> partition(std::vector<int> &live_samples, int feature_index, double split_value);
+
+    // kernels, templated on the column type (float/double, 8/16 bit codes), on
+    // the comparison used for splitting and on the BuildPolicy. Gains are
+    // accumulated in double.
+    template <typename T>
+    std::vector<T> gather_column(const std::vector<T> &column, std::vector<int> &live_samples);
+    template <typename T, typename Split, typename Policy>
+    void find_splits(int feature_index, std::vector<T> &column_live, std::vector<double> &gradients_live,
+                double privacy_budget_for_node, std::vector<SplitCandidate> &candidates);
+    template <typename T, typename Split>
+    void samples_left_right_partition(std::vector<int> &lhs, std::vector<T> &column_live, T split_value);
+    template <typename T, typename Split, typename Policy>
+    double compute_gain(std::vector<T> &column_live, std::vector<double> &gradients_live,
+                T split_value, int &lhs_size);
+    template <typename Policy>
     int exponential_mechanism(std::vector<SplitCandidate> &probs);
+    template <typename Policy>
     void add_laplacian_noise(double laplace_scale);
 
 public:
     // constructors
-    DPTree(ModelParams *params, TreeParams *tree_params, DataSet *dataset, size_t tree_index);
+    DPTree(ModelParams *params, RunContext *context, TreeParams *tree_params, const FeatureMatrix *features,
+        const std::vector<int> *rows, const std::vector<double> *gradients, size_t tree_index);
     ~DPTree();
 
     // fields
     TreeNode *root_node;
 
     // methods
-    std::vector<double> predict(VVD &X);
-    void fit();
+    std::vector<double> predict(const VVF &X);
+    std::vector<double> predict(const FeatureMatrix &X, const std::vector<int> &rows);
+    void fit(Random &random);
     void recursive_print_tree(TreeNode* node);
     void delete_tree(TreeNode *node);
+    std::vector<FlatNode> flatten();
+    void from_flat(const FlatNode *nodes, size_t num_nodes);
 };
 
 #endif // DIFFPRIVTREE_H
\ No newline at end of file
@@ -2,12 +2,20 @@
 #define LAPLACE_H
 
 #include <random>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include "vector_math.h"
 
 /*
     This method for sampling from laplace distribution is described here:
     https://www.johndcook.com/blog/2018/03/13/generating-laplace-random-variables/
     DPBoost also relies on this mechanism:
     https://github.com/QinbinLi/DPBoost/blob/1174730f9b99aca8389c0721fc3864402236e5cd/include/LightGBM/random_generator.h
+
+    fill() draws many samples at once via the inverse cdf instead:
+    u uniform in (0,1) -> scale * log(2u) if u < 1/2, else -scale * log(2(1-u))
+    The uniforms come from xoshiro256+ (seeded through splitmix64), the logs from vlog.
 */
 class Laplace
 {
@@ -17,9 +25,37 @@ private:
     std::default_random_engine generator1;
     std::default_random_engine generator2;
     std::exponential_distribution<double> distribution;
+    uint64_t state[4];
+
+    void seed_fast_generator(uint64_t seed)
+    {
+    for (int i=0; i<4; i++) {
+        // splitmix64
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        state[i] = z ^ (z >> 31);
+    }
+    }
+
+    // xoshiro256+, the upper 53 bits -> double in (0,1)
+    double next_uniform()
+    {
+    uint64_t result = state[0] + state[3];
+    uint64_t t = state[1] << 17;
+    state[2] ^= state[0];
+    state[3] ^= state[1];
+    state[1] ^= state[2];
+    state[0] ^= state[3];
+    state[2] ^= t;
+    state[3] = (state[3] << 45) | (state[3] >> 19);
+    return ((result >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+    }
+
 public:
-    Laplace(int seed): generator(seed){};
-    Laplace(double _scale, int seed): scale(_scale), generator(seed), distribution(1.0/_scale){};
+    Laplace(int seed): generator(seed) {seed_fast_generator(seed);};
+    Laplace(double _scale, int seed): scale(_scale), generator(seed), distribution(1.0/_scale)
+        {seed_fast_generator(seed);};
 
     double return_a_random_variable()
     {
@@ -36,6 +72,32 @@ public:
     double e2 = distribution2(generator);
     return e1-e2;
     }
+
+    // n samples of Laplace(0, scale)
+    void fill(double *out, size_t n)
+    {
+    const size_t CHUNK = 256;
+    double signs[CHUNK];
+    for (size_t begin=0; begin<n; begin+=CHUNK) {
+        size_t len = std::min(CHUNK, n - begin);
+        double *chunk = out + begin;
+        for (size_t i=0; i<len; i++) {
+            double u = next_uniform();
+            bool lower = u < 0.5;
+            chunk[i] = lower ? 2 * u : 2 * (1 - u);
+            signs[i] = lower ? scale : -scale;
+        }
+        vlog(chunk, chunk, len);
+        for (size_t i=0; i<len; i++) {
+            chunk[i] *= signs[i];
+        }
+    }
+    }
+
+    void fill(std::vector<double> &out)
+    {
+    fill(out.data(), out.size());
+    }
 };
 
 #endif /* LAPLACE_H */
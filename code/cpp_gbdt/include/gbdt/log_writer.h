@@ -0,0 +1,49 @@
+#ifndef LOG_WRITER_H
+#define LOG_WRITER_H
+
+#include <condition_variable>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+
+/*
+    Writes lines to a stream from a background thread. Callers only append to
+    an in-memory buffer, once it holds buffer_size bytes the thread takes it
+    over and writes it in one go (meanwhile the next buffer fills up).
+    - lines of concurrent callers don't mix, their order is the order of write()
+    - callers wait only if the thread falls behind by several buffers
+    - the stream is flushed by flush() and on destruction, a crash loses what
+      was still buffered
+    The stream has to outlive the writer and must not be written to otherwise.
+*/
+class AsyncLogWriter
+{
+public:
+    explicit AsyncLogWriter(std::ostream &out, size_t buffer_size = 1 << 16);
+    ~AsyncLogWriter();
+    AsyncLogWriter(const AsyncLogWriter &) = delete;
+    AsyncLogWriter &operator=(const AsyncLogWriter &) = delete;
+
+    void write(const std::string &line);    // appends a newline
+    void flush();                           // returns once everything so far is in the stream
+
+private:
+    // fields
+    std::ostream &out;
+    size_t buffer_size;
+    std::string buffer;         // being filled by write()
+    bool writing = false;       // the thread has a buffer in hand
+    size_t flushes = 0;         // callers waiting in flush()
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable wake;       // the thread has something to do
+    std::condition_variable written;    // the thread is done with a buffer
+    std::thread thread;
+
+    // methods
+    void run();
+};
+
+#endif // LOG_WRITER_H
@@ -4,11 +4,24 @@
 #include <vector>
 
 // abstract class
+// A task has K outputs per sample (K classes for multi-class, otherwise 1).
+// Predictions, tree outputs and gradients of n samples are stored in K blocks
+// of n values: [class 0 | class 1 | ... ], y always has one label per sample.
 class Task
 {
 public:
-    virtual std::vector<double> compute_gradients(std::vector<double> &y, std::vector<double> &y_pred) = 0;
-    virtual double compute_init_score(std::vector<double> &y) = 0;
+    virtual ~Task() {};
+    virtual int num_outputs() const { return 1; }
+    // verification: exact math and gradients rounded like the python implementation
+    virtual std::vector<double> compute_gradients(std::vector<double> &y, std::vector<double> &y_pred,
+        bool verification) = 0;
+    // fused & in place: add the new trees' outputs to the cached sums of tree outputs,
+    // then recompute the gradients from the predictions (sum * learning_rate + init_score)
+    virtual void update_gradients(const std::vector<double> &y, std::vector<double> &tree_sums,
+        const std::vector<double> &tree_pred, double learning_rate, const std::vector<double> &init_score,
+        std::vector<double> &gradients, bool verification) = 0;
+    // one per output
+    virtual std::vector<double> compute_init_score(std::vector<double> &y) = 0;
     virtual double compute_score(std::vector<double> &y, std::vector<double> y_pred) = 0;
 };
 
@@ -18,10 +31,14 @@ class Regression : public Task
 {
 public:
 
-    virtual std::vector<double> compute_gradients(std::vector<double> &y, std::vector<double> &y_pred);
+    virtual std::vector<double> compute_gradients(std::vector<double> &y, std::vector<double> &y_pred,
+        bool verification);
+    virtual void update_gradients(const std::vector<double> &y, std::vector<double> &tree_sums,
+        const std::vector<double> &tree_pred, double learning_rate, const std::vector<double> &init_score,
+        std::vector<double> &gradients, bool verification);
     
     // mean
-    virtual double compute_init_score(std::vector<double> &y);
+    virtual std::vector<double> compute_init_score(std::vector<double> &y);
 
     // RMSE
     virtual double compute_score(std::vector<double> &y, std::vector<double> y_pred);
@@ -33,10 +50,38 @@ class BinaryClassification : public Task
 public:
 
     // expit
-    virtual std::vector<double> compute_gradients(std::vector<double> &y, std::vector<double> &y_pred);
+    virtual std::vector<double> compute_gradients(std::vector<double> &y, std::vector<double> &y_pred,
+        bool verification);
+    virtual void update_gradients(const std::vector<double> &y, std::vector<double> &tree_sums,
+        const std::vector<double> &tree_pred, double learning_rate, const std::vector<double> &init_score,
+        std::vector<double> &gradients, bool verification);
     
     // logit
-    virtual double compute_init_score(std::vector<double> &y);
+    virtual std::vector<double> compute_init_score(std::vector<double> &y);
+
+    // misclassification rate
+    virtual double compute_score(std::vector<double> &y, std::vector<double> y_pred);
+};
+
+// uses Multinomial Deviance as cost/loss function, one tree per class and round.
+// y holds the label-encoded classes 0..K-1
+class MultiClassification : public Task
+{
+private:
+    int num_classes;
+public:
+    MultiClassification(int num_classes) : num_classes(num_classes) {};
+    virtual int num_outputs() const { return num_classes; }
+
+    // softmax
+    virtual std::vector<double> compute_gradients(std::vector<double> &y, std::vector<double> &y_pred,
+        bool verification);
+    virtual void update_gradients(const std::vector<double> &y, std::vector<double> &tree_sums,
+        const std::vector<double> &tree_pred, double learning_rate, const std::vector<double> &init_score,
+        std::vector<double> &gradients, bool verification);
+
+    // log of the class priors
+    virtual std::vector<double> compute_init_score(std::vector<double> &y);
 
     // misclassification rate
     virtual double compute_score(std::vector<double> &y, std::vector<double> y_pred);
@@ -0,0 +1,86 @@
+#ifndef MODEL_FILE_H
+#define MODEL_FILE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "tree_node.h"
+#include "utils.h"
+
+
+/*
+    Layout of a saved ensemble (DPEnsemble::save). Everything is at a fixed,
+    aligned offset, so the file can be mmap-ed and used in place (MappedModel).
+    Native byte order.
+        ModelFileHeader
+        params              remaining ModelParams (only needed to load the model
+                            back into a DPEnsemble, see dp_ensemble.cpp)
+        init_score          double[num_outputs]
+        categorical         uint8_t[num_features], 1 for categorical features
+        tree_offsets        uint64_t[num_trees + 1], tree t consists of
+                            nodes[tree_offsets[t], tree_offsets[t+1])
+        nodes               FlatNode[] (64 byte aligned), child indices are
+                            relative to the first node of their tree
+*/
+static const char MODEL_MAGIC[8] = {'D','P','G','B','D','T','\0','\0'};
+static const uint32_t MODEL_VERSION = 2;
+enum TaskId : uint32_t { REGRESSION = 0, BINARY_CLASSIFICATION = 1, MULTI_CLASSIFICATION = 2 };
+
+struct ModelFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t task;              // TaskId
+    uint32_t num_outputs;       // K
+    uint32_t num_features;      // a row needs at least this many values
+    uint64_t num_trees;         // trees[round * K + class]
+    double learning_rate;
+    uint64_t params_offset, params_size;
+    uint64_t init_score_offset;
+    uint64_t categorical_offset;
+    uint64_t tree_offsets_offset;
+    uint64_t nodes_offset;
+    uint64_t file_size;
+};
+static_assert(sizeof(ModelFileHeader) == 96, "ModelFileHeader is written to files as is");
+
+// checks that data[0,size) is a complete and consistent model file (incl. every
+// node of every tree). Throws std::runtime_error otherwise.
+const ModelFileHeader *check_model_file(const char *data, size_t size);
+
+
+// read-only view of a model file mapped into memory. The trees are traversed
+// in place, nothing is parsed or copied, so processes scoring with the same
+// file share one copy of it (the page cache).
+class MappedModel
+{
+public:
+    // constructors
+    MappedModel(const std::string &path);
+    ~MappedModel();
+    MappedModel(const MappedModel &) = delete;
+    MappedModel &operator=(const MappedModel &) = delete;
+
+    // methods
+    int num_outputs() const { return header->num_outputs; }
+    size_t num_features() const { return header->num_features; }
+    size_t num_trees() const { return header->num_trees; }
+    // the K outputs for one row (num_features values), as DPEnsemble::predict
+    void predict(const feature_t *row, double *out) const;
+    std::vector<double> predict(const VVF &X) const;
+
+private:
+    // fields
+    const char *data;
+    size_t size;
+    const ModelFileHeader *header;
+    const double *init_score;
+    const uint8_t *categorical;
+    const uint64_t *tree_offsets;
+    const FlatNode *nodes;
+
+    // methods
+    double predict_tree(size_t tree, const feature_t *row) const;
+};
+
+#endif // MODEL_FILE_H
@@ -0,0 +1,71 @@
+#ifndef RUN_CONTEXT_H
+#define RUN_CONTEXT_H
+
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include "log_writer.h"
+
+
+// random numbers with their own state, the same sequence as std::rand after
+// std::srand(seed) (glibc's generator, through random_r). Thread-safe.
+class Random
+{
+public:
+    explicit Random(unsigned seed = 1);
+    Random(const Random &) = delete;
+    Random &operator=(const Random &) = delete;
+
+    void seed(unsigned seed);
+    int next();     // in [0, RAND_MAX], like std::rand
+    size_t uniform(size_t n);   // in [0, n), n <= RAND_MAX + 1, without modulo bias
+
+private:
+    std::mutex mutex;
+    char state[128];
+    struct random_data data;
+};
+
+
+// counters of a run, updated by the ensemble as it trains
+struct RunMetrics {
+    std::atomic<size_t> trees{0};       // trees built
+    std::atomic<size_t> tree_rows{0};   // rows they were built on, summed up
+};
+
+
+/*
+    Everything a training run used to take from process-wide globals. Each
+    DPEnsemble gets one (and hands it to its trees), runs with their own
+    contexts can train and predict concurrently in one process.
+    A context can be reused by runs that follow each other (e.g. the folds of
+    a cv), they then continue its random sequence.
+*/
+struct RunContext {
+    explicit RunContext(unsigned seed = 1) : random(seed) {}
+    RunContext(const RunContext &) = delete;
+    RunContext &operator=(const RunContext &) = delete;
+
+    // deterministic runs that can be compared to the python implementation:
+    // no random sampling or noise, rounding at certain places, scalar math,
+    // intermediate values are written to verification_log (buffered, it's
+    // complete once the context is destroyed or flush_verification_log returned)
+    bool verification = false;
+    size_t fold_index = 0;                      // cv fold, shows up in the verification log
+    std::ostream *verification_log = nullptr;   // set before the first line is logged
+    Random random;
+    RunMetrics metrics;
+
+    // one line to verification_log (if set)
+    void log_verification(const std::string &line);
+    void flush_verification_log();
+
+private:
+    std::mutex log_mutex;
+    std::unique_ptr<AsyncLogWriter> log_writer;
+};
+
+#endif // RUN_CONTEXT_H
@@ -0,0 +1,44 @@
+#ifndef STATISTICS_H
+#define STATISTICS_H
+
+#include <cstddef>
+
+
+// mean and variance of a stream of values (Welford), O(1) memory
+class RunningStats
+{
+public:
+    void add(double x);
+    size_t count() const { return n; }
+    double mean() const { return mu; }
+    double stdev() const;           // population, as compute_stdev
+    double sample_stdev() const;
+    // 95% confidence interval of the mean (Student's t), half of its width
+    double ci95_half_width() const;
+
+private:
+    size_t n = 0;
+    double mu = 0, m2 = 0;
+};
+
+
+// streaming estimate of the p-quantile with five markers (P-square algorithm,
+// Jain & Chlamtac 1985), O(1) memory. Exact for the first five values.
+class P2Quantile
+{
+public:
+    explicit P2Quantile(double p);
+    void add(double x);
+    double value() const;
+
+private:
+    double p;
+    size_t count = 0;
+    double heights[5];
+    double positions[5], desired[5], increments[5];
+
+    double parabolic(int i, double d) const;
+    double linear(int i, int d) const;
+};
+
+#endif // STATISTICS_H
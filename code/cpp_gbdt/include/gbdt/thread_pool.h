@@ -0,0 +1,92 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+/*
+    Process-wide pool of worker threads that all parallel work is submitted to
+    (folds, the trees of a round, features, row chunks), so nested parallelism
+    shares one set of threads instead of each level spawning its own.
+    - every worker has its own deque: it pushes and pops its own tasks at the
+      back (newest first), idle workers steal from the front of the others.
+      Tasks from threads outside the pool go to a shared queue.
+    - a thread waiting for a TaskGroup runs the group's pending tasks meanwhile,
+      so nesting can't deadlock the pool. It only helps with its own group: an
+      unrelated task (e.g. another fold) would nest on its stack and delay it.
+    The number of workers is fixed on first use, see set_num_workers.
+*/
+class TaskGroup;
+
+class ThreadPool
+{
+public:
+    static ThreadPool &instance();
+    // 0 = one per core. Only has an effect before the pool is first used.
+    static void set_num_workers(size_t num_workers);
+    // has the pool been used (its threads started)? Forking is only safe before
+    static bool started();
+
+    ~ThreadPool();
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    size_t num_workers() const { return threads.size(); }
+    void submit(std::function<void()> task, const TaskGroup *group = nullptr);
+    // runs a pending task (of the group, if given) on the calling thread, false if there was none
+    bool run_one(const TaskGroup *group = nullptr);
+
+private:
+    struct Task {
+        std::function<void()> function;
+        const TaskGroup *group;
+    };
+    struct TaskQueue {
+        std::deque<Task> tasks;
+        std::mutex mutex;
+    };
+
+    // fields
+    std::vector<std::unique_ptr<TaskQueue>> queues;  // one per worker, the last one is shared
+    std::vector<std::thread> threads;
+    std::atomic<size_t> pending;
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    // methods
+    explicit ThreadPool(size_t num_workers);
+    bool pop(std::function<void()> &task, const TaskGroup *group);
+    void work(size_t index);
+};
+
+
+// a set of tasks to wait for. wait() rethrows the first exception of a task.
+class TaskGroup
+{
+public:
+    TaskGroup(ThreadPool &pool = ThreadPool::instance()) : pool(pool), remaining(0) {}
+    ~TaskGroup();
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup &operator=(const TaskGroup &) = delete;
+
+    void run(std::function<void()> task);
+    void wait();
+
+private:
+    ThreadPool &pool;
+    std::atomic<size_t> remaining;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable finished;
+};
+
+#endif // THREAD_POOL_H
@@ -1,6 +1,8 @@
 #ifndef TREENODE_H
 #define TREENODE_H
 
+#include <cstdint>
+#include <cstddef>
 
 class TreeNode {
 public:
@@ -22,4 +24,21 @@ public:
 };
 
 
+// a node in flat form, e.g. for saving a tree. A tree is an array of these in
+// preorder (root first), children are referenced by their index, -1 for leaves
+struct FlatNode {
+    int32_t split_attr;
+    int32_t depth;
+    int32_t left, right;
+    double split_value;
+    double prediction;
+};
+static_assert(sizeof(FlatNode) == 32, "FlatNode is written to files as is");
+
+// are nodes[0, num_nodes) exactly one tree in the preorder layout that
+// DPTree::flatten writes (left child right after its parent, right child right
+// after the left subtree)? Then every node but the root has exactly one parent.
+bool is_preorder_tree(const FlatNode *nodes, size_t num_nodes);
+
+
 #endif // TREENODE_H
\ No newline at end of file
@@ -3,19 +3,51 @@
 
 #include <vector>
 #include <string>
+#include <fstream>
+#include <algorithm>
+#include "thread_pool.h"
 typedef std::vector<std::vector<double>> VVD;
+
+// precision of the stored features (X). "make float" stores them as float32,
+// halving the size of X. gradients, gains and all sums remain double.
+#ifdef FLOAT_FEATURES
+typedef float feature_t;
+#else
+typedef double feature_t;
+#endif
+typedef std::vector<std::vector<feature_t>> VVF;
 #include "parameters.h"
 
 
 // method declarations
 ModelParams create_default_params();
 double clamp(double n, double lower, double upper);
-double log_sum_exp(std::vector<double> arr);
+double log_sum_exp(std::vector<double> arr, bool exact = false);  // exact: see vexp
 void string_pad(std::string &str, const size_t num, const char paddingChar = ' ');
 double compute_mean(std::vector<double> &vec);
 double compute_stdev(std::vector<double> &vec, double mean);
 
 std::string get_time_string();
+void open_output_file(std::ofstream &out, const std::string &path);
+size_t number_of_chunks(size_t n, size_t min_chunk_size);
+
+
+// splits [0,n) into num_chunks contiguous chunks and calls f(chunk, begin, end)
+// for each of them, one task per chunk on the thread pool (the caller takes the
+// first one and helps with the others while waiting)
+template <typename F>
+void parallel_for_chunks(size_t n, size_t num_chunks, F f)
+{
+    size_t chunk_size = (n + num_chunks - 1) / num_chunks;
+    TaskGroup group;
+    for (size_t chunk=1; chunk<num_chunks; chunk++) {
+        size_t begin = std::min(n, chunk * chunk_size);
+        size_t end = std::min(n, begin + chunk_size);
+        group.run([&f, chunk, begin, end]() { f(chunk, begin, end); });
+    }
+    f(0, 0, std::min(n, chunk_size));
+    group.wait();
+}
 
 
 #endif // UTILS_H
\ No newline at end of file
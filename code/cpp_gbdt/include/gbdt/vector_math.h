@@ -0,0 +1,30 @@
+#ifndef VECTOR_MATH_H
+#define VECTOR_MATH_H
+
+#include <cstddef>
+
+/*
+    Vectorized exp / log on arrays, used in the hot paths (log_sum_exp, the
+    exponential mechanism, the sigmoid of BinaryClassification, dp quantiles).
+    - AVX-512 or AVX2 (+FMA) versions, if the compiler is allowed to use them
+      (e.g. "make fast" -> -march=native)
+    - otherwise, and always with exact = true (verification runs), the scalar
+      std::exp / std::log.
+      That path gives bit-identical results to the plain loops.
+    in and out may be the same array.
+
+    Error of the vector versions, measured against std::exp / std::log
+    (2e7 random inputs each, AVX2 and AVX-512):
+    - vexp: <= 1 ulp for x in [log(DBL_MIN), 709.08]. Below that the result is
+      flushed to 0 (no subnormals), above it is +inf (std::exp overflows at 709.78).
+    - vlog: <= 1 ulp for positive normal x. 0 -> -inf, x < 0 -> NaN, inf -> inf.
+      (subnormal inputs are not handled)
+    NaN inputs stay NaN.
+*/
+void vexp(const double *in, double *out, size_t n, bool exact = false);
+void vlog(const double *in, double *out, size_t n, bool exact = false);
+
+// 1 / (1 + exp(-x))
+void vsigmoid(const double *in, double *out, size_t n, bool exact = false);
+
+#endif /* VECTOR_MATH_H */
@@ -14,18 +14,40 @@
 #define LOG_DEBUG_MACRO_CHOOSER(...) \
     GET_9TH_ARG(__VA_ARGS__, LOG_DEBUG_ARG, LOG_DEBUG_ARG, LOG_DEBUG_ARG, LOG_DEBUG_ARG, LOG_DEBUG_ARG, LOG_DEBUG_ARG, LOG_DEBUG_ARG, LOG_DEBUG_NO_ARG, )
 
+// compile-time threshold, levels numbered as in spdlog. Calls below it are
+// compiled out (arguments still type-checked, never evaluated), the others
+// only build their message if spdlog's runtime level lets it through.
+// e.g. -D LOG_ACTIVE_LEVEL=LOG_LEVEL_INFO (see make fast)
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_OFF 6
+#ifndef LOG_ACTIVE_LEVEL
+#define LOG_ACTIVE_LEVEL LOG_LEVEL_DEBUG
+#endif
+#define LOG_DISABLED(call) ((void) (false and (call, true)))
+
 // Logging functions
 // - can call these two functions with variable number of args, as in python.
 // - only difference is that you have to start enumerating at one, e.g.:
 //   LOG_INFO("This {1} has {2:.0f} bugs", "logger", 0.42)
-#define LOG_INFO(...) LOG_INFO_MACRO_CHOOSER(__VA_ARGS__)(__VA_ARGS__)
-#define LOG_DEBUG(...) LOG_DEBUG_MACRO_CHOOSER(__VA_ARGS__)(__VA_ARGS__)
+#if LOG_ACTIVE_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...) (spdlog::should_log(spdlog::level::info) ? \
+    LOG_INFO_MACRO_CHOOSER(__VA_ARGS__)(__VA_ARGS__) : (void) 0)
+#else
+#define LOG_INFO(...) LOG_DISABLED(LOG_INFO_MACRO_CHOOSER(__VA_ARGS__)(__VA_ARGS__))
+#endif
+#if LOG_ACTIVE_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) (spdlog::should_log(spdlog::level::debug) ? \
+    LOG_DEBUG_MACRO_CHOOSER(__VA_ARGS__)(__VA_ARGS__) : (void) 0)
+#else
+#define LOG_DEBUG(...) LOG_DISABLED(LOG_DEBUG_MACRO_CHOOSER(__VA_ARGS__)(__VA_ARGS__))
+#endif
 
 // highlight
 #define YELLOW(words) "\033[0;40;33m" + words + "\033[0m"
 
-// used for verification, writes to specific file
-#define VERIFICATION_LOG(...) verification_logfile << fmt::format(__VA_ARGS__) << "\n"; verification_logfile.flush()
+// used for verification, writes to the (buffered) verification log of a RunContext
+#define VERIFICATION_LOG(context, ...) (context)->log_verification(fmt::format(__VA_ARGS__))
 
 
 
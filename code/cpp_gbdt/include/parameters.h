@@ -3,6 +3,7 @@
 
 #include <memory>
 #include <vector>
+#include <string>
 #include "loss.h"
 
 
@@ -21,6 +22,14 @@ struct ModelParams {
     bool use_decay = false;
     double l2_threshold = 1.0;
     double l2_lambda = 0.1;
+    int max_bins = 0;   // > 0: trees are built on binned features (<= 256 -> 8 bit codes)
+    double bin_percentile = 95;         // max_bins: the bins span this central share of each feature
+    double bin_privacy_budget = 0.1;    // max_bins: spent on those borders (dp), out of privacy_budget
+    bool reorder_rows = false;  // each dp tree trains on a contiguous copy of its rows
+    int early_stop = 0;     // > 0: stop once the validation score didn't improve for that many rounds
+    bool warm_start = false;    // train() keeps the existing (e.g. loaded) trees and appends nb_trees
+                                // more, using privacy_budget for the new ones only
+    std::string checkpoint;     // non-empty: train() resumes from this file and appends each finished round
     std::vector<int> cat_idx;
     std::vector<int> num_idx;
 };
@@ -30,6 +39,7 @@ struct TreeParams {
     double delta_g;
     double delta_v;
     double tree_privacy_budget;
+    bool leaf_clipping;
 };
 
 
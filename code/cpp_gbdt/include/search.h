@@ -0,0 +1,10 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+
+namespace Search
+{
+    int main(int argc, char *argv[]);
+}
+
+#endif // SEARCH_H
@@ -3,7 +3,7 @@
 #include <iostream>
 #include <iomanip>
 #include <chrono>
-#include <thread>
+#include "gbdt/thread_pool.h"
 #include "parameters.h"
 #include "benchmark.h"
 #include "gbdt/dp_ensemble.h"
@@ -26,6 +26,9 @@ int Benchmark::main(int argc, char *argv[])
     spdlog::set_level(spdlog::level::info);
     spdlog::set_pattern("[%H:%M:%S] [%^%5l%$] %v");
 
+    // worker threads shared by folds, trees and features (0 = one per core)
+    ThreadPool::set_num_workers(0);
+
     // store datasets and their corresponding parameters here
     std::vector<DataSet *> datasets;
     std::vector<ModelParams> parameters;
@@ -67,7 +70,7 @@ int Benchmark::main(int argc, char *argv[])
 
     for(size_t i=0; i<datasets.size(); i++) {
 
-        DataSet *dataset = datasets[i];
+        std::shared_ptr<DataSet> dataset(datasets[i]);
         ModelParams &param = parameters[i];
         std::cout << dataset->name << std::endl;
 
@@ -75,28 +78,27 @@ int Benchmark::main(int argc, char *argv[])
 
         // split the data for each fold
         std::vector<TrainTestSplit *> cv_inputs = create_cross_validation_inputs(dataset, 5);
-        delete dataset;
         std::chrono::steady_clock::time_point time_begin = std::chrono::steady_clock::now();
         
-        // prepare the ressources for each thread
-        std::vector<std::thread> threads(cv_inputs.size());
+        // prepare the ressources for each fold, every fold has its own run context
         std::vector<DPEnsemble> ensembles;
+        std::vector<std::unique_ptr<RunContext>> contexts;
         for (auto split : cv_inputs) {
             if(param.scale_y){
-                split->train.scale_y(param, -1, 1);
+                split->scale_y(param, -1, 1);
             }
-            ensembles.push_back(DPEnsemble(&param) );
-        }
-
-        // threads start training on ther respective folds
-        for(size_t thread_id=0; thread_id<threads.size(); thread_id++){
-            threads[thread_id] = std::thread(&DPEnsemble::train, &ensembles[thread_id], &(cv_inputs[thread_id]->train));
+            contexts.push_back(std::unique_ptr<RunContext>(new RunContext(std::rand())));
+            ensembles.push_back(DPEnsemble(&param, contexts.back().get()) );
         }
 
-        // join once done
-        for (auto &thread : threads) {
-            thread.join();
+        // the folds train as tasks of the thread pool, which their trees also use
+        TaskGroup folds;
+        for (size_t fold=0; fold<cv_inputs.size(); fold++) {
+            folds.run([&ensembles, &cv_inputs, fold]() {
+                ensembles[fold].train(cv_inputs[fold]);
+            });
         }
+        folds.wait();
 
         /* compute scores */
 
@@ -105,22 +107,29 @@ int Benchmark::main(int argc, char *argv[])
             TrainTestSplit *split = cv_inputs[ensemble_id];
             
             // predict with the test set
-            std::vector<double> y_pred = ensemble->predict(split->test.X);
+            std::vector<double> y_pred = ensemble->predict(split->X(), split->test_indices());
 
             if(param.scale_y){
-                inverse_scale_y(param, split->train.scaler, y_pred);
+                inverse_scale_y(param, split->scaler, y_pred);
             }
 
             // compute score            
-            double score = param.task->compute_score(split->test.y, y_pred);
+            std::vector<double> y_test = split->test_y();
+            double score = param.task->compute_score(y_test, y_pred);
             std::cout << std::setprecision(9) << score << " " << std::flush;
             delete split;
         } 
 
-        // print elapsed time (for 5 fold cv)
+        // print elapsed time (for 5 fold cv) and how much was trained
         std::chrono::steady_clock::time_point time_end = std::chrono::steady_clock::now();
         double elapsed = std::chrono::duration_cast<std::chrono::milliseconds> (time_end - time_begin).count();
-        std::cout << "  (" << std::fixed << std::setprecision(2) << elapsed/1000 << "s)" << std::endl;
+        size_t num_trees = 0, tree_rows = 0;
+        for (auto &context : contexts) {
+            num_trees += context->metrics.trees;
+            tree_rows += context->metrics.tree_rows;
+        }
+        std::cout << "  (" << std::fixed << std::setprecision(2) << elapsed/1000 << "s, " << num_trees
+            << " trees on " << tree_rows << " rows)" << std::endl;
     }
     return 0;
 }
@@ -7,8 +7,7 @@
 #include <algorithm>
 #include "dataset_parser.h"
 #include "data.h"
-
-extern bool VERIFICATION_MODE;
+#include "gbdt/run_context.h"
 
 /* Parsing:
     - the data file needs to be comma separated
@@ -24,7 +23,7 @@ extern bool VERIFICATION_MODE;
 
 
 DataSet *Parser::get_abalone(std::vector<ModelParams> &parameters,
-        size_t num_samples, bool use_default_params)
+        size_t num_samples, bool use_default_params, bool shuffle)
 {
     std::string file = "datasets/real/abalone.data";
     std::string name = "abalone";
@@ -38,12 +37,32 @@ DataSet *Parser::get_abalone(std::vector<ModelParams> &parameters,
     std::vector<int> cat_values = {}; // empty -> will be filled with the present values in the dataset
 
     return parse_file(file, name, num_rows, num_cols, num_samples, task, num_idx,
-        cat_idx, cat_values, target_idx, drop_idx, parameters, use_default_params);
+        cat_idx, cat_values, target_idx, drop_idx, parameters, use_default_params, shuffle);
+}
+
+
+// multi-class: predict the sex (M/F/I) of the abalone
+DataSet *Parser::get_abalone_sex(std::vector<ModelParams> &parameters,
+        size_t num_samples, bool use_default_params, bool shuffle)
+{
+    std::string file = "datasets/real/abalone.data";
+    std::string name = "abalone_sex";
+    int num_rows = 4177;
+    int num_cols = 9;
+    std::shared_ptr<MultiClassification> task(new MultiClassification(3));
+    std::vector<int> num_idx = {1,2,3,4,5,6,7,8};
+    std::vector<int> cat_idx = {};
+    std::vector<int> target_idx = {0};
+    std::vector<int> drop_idx = {};
+    std::vector<int> cat_values = {}; // empty -> will be filled with the present values in the dataset
+
+    return parse_file(file, name, num_rows, num_cols, num_samples, task, num_idx,
+        cat_idx, cat_values, target_idx, drop_idx, parameters, use_default_params, shuffle);
 }
 
 
 DataSet *Parser::get_YearPredictionMSD(std::vector<ModelParams> &parameters, 
-        size_t num_samples, bool use_default_params)
+        size_t num_samples, bool use_default_params, bool shuffle)
 {
     std::string file = "datasets/real/YearPredictionMSD.train";
     std::string name = "yearMSD";
@@ -58,12 +77,12 @@ DataSet *Parser::get_YearPredictionMSD(std::vector<ModelParams> &parameters,
     std::vector<int> cat_values = {}; // empty -> will be filled with the present values in the dataset
 
     return parse_file(file, name, num_rows, num_cols, num_samples, task, num_idx,
-        cat_idx, cat_values, target_idx, drop_idx, parameters, use_default_params);
+        cat_idx, cat_values, target_idx, drop_idx, parameters, use_default_params, shuffle);
 }
 
 
 DataSet *Parser::get_adult(std::vector<ModelParams> &parameters,
-        size_t num_samples, bool use_default_params)
+        size_t num_samples, bool use_default_params, bool shuffle)
 {
     std::string file = "datasets/real/adult.data";
     std::string name = "adult";
@@ -77,12 +96,12 @@ DataSet *Parser::get_adult(std::vector<ModelParams> &parameters,
     std::vector<int> cat_values = {}; // empty -> will be filled with the present values in the dataset
 
     return parse_file(file, name, num_rows, num_cols, num_samples, task, num_idx,
-        cat_idx, cat_values, target_idx, drop_idx, parameters, use_default_params);
+        cat_idx, cat_values, target_idx, drop_idx, parameters, use_default_params, shuffle);
 }
 
 
 DataSet *Parser::get_bcw(std::vector<ModelParams> &parameters,
-        size_t num_samples, bool use_default_params)
+        size_t num_samples, bool use_default_params, bool shuffle)
 {
     std::string file = "datasets/real/breast-cancer-wisconsin.data";
     std::string name = "bcw";
@@ -96,7 +115,7 @@ DataSet *Parser::get_bcw(std::vector<ModelParams> &parameters,
     std::vector<int> cat_values = {}; // empty -> will be filled with the present values in the dataset
 
     return parse_file(file, name, num_rows, num_cols, num_samples, task, num_idx,
-        cat_idx, cat_values, target_idx, drop_idx, parameters, use_default_params);
+        cat_idx, cat_values, target_idx, drop_idx, parameters, use_default_params, shuffle);
 }
 
 
@@ -118,10 +137,10 @@ std::vector<std::string> Parser::split_string(const std::string &s, char delim)
 DataSet *Parser::parse_file(std::string dataset_file, std::string dataset_name, int num_rows,
         int num_cols, int num_samples, std::shared_ptr<Task> task, std::vector<int> num_idx,
         std::vector<int> cat_idx, std::vector<int> cat_values, std::vector<int> target_idx, std::vector<int> drop_idx,
-        std::vector<ModelParams> &parameters, bool use_default_params)
+        std::vector<ModelParams> &parameters, bool use_default_params, bool shuffle)
 {
     std::ifstream infile(dataset_file);
-    VVD X;
+    VVF X;
     std::vector<double> y;
     num_samples = std::min(num_samples, num_rows);
 
@@ -142,14 +161,15 @@ DataSet *Parser::parse_file(std::string dataset_file, std::string dataset_name,
         }
     }
 
-    // shuffle the whole dataset at the start. Otherwise, if we use a subset
-    // of a larger dataset, we always end up with the same samples.
+    // shuffle the whole dataset at the start (unless a verification run needs
+    // the file order). Otherwise, if we use a subset of a larger dataset, we
+    // always end up with the same samples.
     std::string line;
     std::vector<std::string> whole_dataset;
     while (std::getline(infile, line,'\n')) {
         whole_dataset.push_back(line);
     }
-    if(not VERIFICATION_MODE) {
+    if(shuffle) {
         std::random_shuffle(whole_dataset.begin(), whole_dataset.end());
     }
 
@@ -163,7 +183,7 @@ DataSet *Parser::parse_file(std::string dataset_file, std::string dataset_name,
             break;
         }
         std::vector<std::string> strings = split_string(line, ',');
-        std::vector<double> X_row;
+        std::vector<feature_t> X_row;
 
         // drop dataset rows that contain missing entries ("?")
         if (line.find('?') < line.length() or line.empty()) {
@@ -239,11 +259,18 @@ DataSet *Parser::parse_file(std::string dataset_file, std::string dataset_name,
         }
     }
 
-    DataSet *dataset = new DataSet(X,y);
+    DataSet *dataset = new DataSet(X, y, cat_idx);
     dataset->name = std::string(dataset_name) + std::string("_size_") + std::to_string(num_samples);
 
     parameters.back().num_idx = num_idx;
     parameters.back().cat_idx = cat_idx;
 
+    // map the numerical features to bin codes, once for all folds
+    ModelParams &params = parameters.back();
+    if (params.max_bins > 0) {
+        RunContext context(std::rand());
+        dataset->X.bin(params.max_bins, params.bin_percentile, params.bin_privacy_budget, context);
+    }
+
     return dataset;
 }
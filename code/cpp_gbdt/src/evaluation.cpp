@@ -3,11 +3,21 @@
 #include <iostream>
 #include <iomanip>
 #include <chrono>
-#include <thread>
+#include "gbdt/thread_pool.h"
 #include <algorithm>
+#include <deque>
+#include <mutex>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <stdexcept>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include "parameters.h"
 #include "evaluation.h"
 #include "utils.h"
+#include "gbdt/statistics.h"
 #include "gbdt/dp_ensemble.h"
 #include "dataset_parser.h"
 #include "data.h"
@@ -15,10 +25,294 @@
 
 typedef std::chrono::steady_clock::time_point Timer;
 
+// one training run of the evaluation
+struct EvaluationJob {
+    size_t budget;      // index into the budgets
+    size_t fold;
+    int repetition;
+    double cost;        // estimated, only used to order the jobs
+    unsigned seed;      // of the run's random numbers
+};
+
+// scores of one budget, aggregated as they come in (nothing is stored per run)
+struct BudgetScores {
+    RunningStats stats;
+    P2Quantile median = P2Quantile(0.5);
+    P2Quantile q025 = P2Quantile(0.025);
+    P2Quantile q975 = P2Quantile(0.975);
+
+    void add(double score)
+    {
+        stats.add(score);
+        median.add(score);
+        q025.add(score);
+        q975.add(score);
+    }
+};
+
+// worker -> parent over its result pipe. job = -1: ready for the first job
+struct WorkerMessage {
+    int32_t job;
+    int32_t failed;     // the run threw, see error
+    double score;
+    double seconds;
+    char error[128];
+};
+
+// non-dp trees train on all rows, a dp ensemble's trees share them
+static double estimated_cost(const ModelParams &params, size_t num_rows)
+{
+    return params.use_dp ? num_rows : (double) num_rows * params.nb_trees;
+}
+
+static std::string describe(const EvaluationJob &job)
+{
+    return fmt::format("(budget #{}, fold {}, repetition {})", job.budget, job.fold, job.repetition);
+}
+
+// false if the other end is gone
+static bool read_all(int fd, void *data, size_t size)
+{
+    char *pos = static_cast<char *>(data);
+    while (size > 0) {
+        ssize_t n = ::read(fd, pos, size);
+        if (n == -1 and errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        pos += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void *data, size_t size)
+{
+    const char *pos = static_cast<const char *>(data);
+    while (size > 0) {
+        ssize_t n = ::write(fd, pos, size);
+        if (n == -1 and errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return false;
+        }
+        pos += n;
+        size -= n;
+    }
+    return true;
+}
+
+// how a reaped worker ended
+static std::string exit_reason(int status)
+{
+    if (WIFSIGNALED(status)) {
+        return fmt::format("was killed by signal {} ({})", WTERMSIG(status), strsignal(WTERMSIG(status)));
+    }
+    return fmt::format("exited with status {}", WEXITSTATUS(status));
+}
+
+/*
+    Runs the jobs in num_processes forked worker processes. The workers get the
+    parsed dataset and folds through fork: the pages are shared copy-on-write,
+    nothing is copied as long as they are only read (training never writes to
+    them). There is no separate shared-memory segment or mmap-ed snapshot of
+    the dataset. The workers pull job indices from their own pipe and send the
+    scores back over their own result pipe; the parent records them.
+    - a job that throws is reported back, the parent then hands out no more
+      jobs, waits for the running ones and throws
+    - a worker that dies (crash, OOM kill) shows up as EOF on its result pipe,
+      it is reaped and its job goes to another worker. A job that takes down
+      two workers counts as failed
+    Must be called before the thread pool is first used in this process: its
+    threads don't survive a fork, a child could inherit its mutexes locked by
+    threads that no longer exist. Each worker starts its own pool.
+*/
+static void run_in_processes(const std::vector<EvaluationJob> &jobs, size_t num_processes,
+    const std::function<double(const EvaluationJob &, double &)> &run_job,
+    const std::function<void(const EvaluationJob &, double, double)> &record)
+{
+    if (ThreadPool::started()) {
+        throw std::runtime_error("evaluation: the thread pool is already running, can't fork workers");
+    }
+    // a dead worker's job pipe must not kill the parent, writes fail instead
+    void (*sigpipe_handler)(int) = signal(SIGPIPE, SIG_IGN);
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<int> job_pipes, result_pipes;
+    std::vector<pid_t> workers;
+    std::vector<bool> alive;    // not reaped yet
+
+    // closing the job pipes lets the workers finish, then reap them
+    auto stop_workers = [&]() {
+        for (size_t w=0; w<workers.size(); w++) {
+            close(job_pipes[w]);
+            close(result_pipes[w]);
+            if (alive[w]) {
+                waitpid(workers[w], nullptr, 0);
+            }
+        }
+        signal(SIGPIPE, sigpipe_handler);
+    };
+
+    std::cout << std::flush;
+    for (size_t w=0; w<num_processes; w++) {
+        int job_pipe[2], result_pipe[2];
+        if (pipe(job_pipe) != 0 or pipe(result_pipe) != 0) {
+            stop_workers();
+            throw std::runtime_error("can't create the evaluation worker pipes");
+        }
+        pid_t pid = fork();
+        if (pid == -1) {
+            stop_workers();
+            throw std::runtime_error("can't fork an evaluation worker");
+        }
+        if (pid == 0) {
+            // worker: run jobs until -1 or the parent is gone, the cores are
+            // split between the workers
+            close(job_pipe[1]);
+            close(result_pipe[0]);
+            for (size_t other=0; other<job_pipes.size(); other++) {
+                close(job_pipes[other]);
+                close(result_pipes[other]);
+            }
+            // no pool was inherited (see above), the first use starts a fresh one
+            ThreadPool::set_num_workers(std::max((size_t) 1, cores / num_processes));
+            WorkerMessage message = {};
+            message.job = -1;
+            int32_t job;
+            while (write_all(result_pipe[1], &message, sizeof(message))
+                    and read_all(job_pipe[0], &job, sizeof(job)) and job != -1) {
+                message = {};
+                message.job = job;
+                try {
+                    message.score = run_job(jobs[job], message.seconds);
+                } catch (const std::exception &e) {
+                    message.failed = 1;
+                    strncpy(message.error, e.what(), sizeof(message.error) - 1);
+                } catch (...) {
+                    message.failed = 1;
+                    strncpy(message.error, "unknown exception", sizeof(message.error) - 1);
+                }
+            }
+            // skip the parent's exit handlers and stream buffers
+            _exit(0);
+        }
+        close(job_pipe[0]);
+        close(result_pipe[1]);
+        job_pipes.push_back(job_pipe[1]);
+        result_pipes.push_back(result_pipe[0]);
+        workers.push_back(pid);
+        alive.push_back(true);
+    }
+
+    // hand out the jobs in order, each to the next idle worker
+    std::deque<int32_t> queue;
+    for (size_t job=0; job<jobs.size(); job++) {
+        queue.push_back((int32_t) job);
+    }
+    std::vector<int> crashes(jobs.size(), 0);
+    std::vector<int32_t> in_hand(num_processes, -1);
+    std::vector<bool> idle(num_processes, false);
+    size_t num_alive = num_processes;
+    std::string failure;
+    while (num_alive > 0) {
+        std::vector<pollfd> fds;
+        std::vector<size_t> fd_workers;
+        for (size_t w=0; w<num_processes; w++) {
+            if (alive[w]) {
+                fds.push_back({result_pipes[w], POLLIN, 0});
+                fd_workers.push_back(w);
+            }
+        }
+        if (poll(fds.data(), fds.size(), -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            failure = std::string("evaluation: poll failed: ") + strerror(errno);
+            break;
+        }
+        for (size_t i=0; i<fds.size(); i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            size_t w = fd_workers[i];
+            WorkerMessage message;
+            if (not read_all(result_pipes[w], &message, sizeof(message))) {
+                // the worker is gone
+                int status = 0;
+                waitpid(workers[w], &status, 0);
+                alive[w] = false;
+                idle[w] = false;
+                num_alive--;
+                int32_t job = in_hand[w];
+                in_hand[w] = -1;
+                if (job == -1) {
+                    continue;
+                }
+                std::string what = fmt::format("evaluation worker {} {} during run {}", w,
+                    exit_reason(status), describe(jobs[job]));
+                if (++crashes[job] < 2 and failure.empty()) {
+                    std::cerr << what << ", retrying the run" << std::endl;
+                    queue.push_front(job);
+                } else if (failure.empty()) {
+                    failure = what;
+                }
+                continue;
+            }
+            in_hand[w] = -1;
+            idle[w] = true;
+            if (message.failed and failure.empty()) {
+                failure = fmt::format("evaluation run {} failed: {}", describe(jobs[message.job]), message.error);
+            } else if (message.job != -1 and not message.failed) {
+                record(jobs[message.job], message.score, message.seconds);
+            }
+        }
+
+        // the worker that just got idle gets the next job. Idle workers are only
+        // let go once nothing is running, a crash might still need them
+        bool running = false;
+        for (size_t w=0; w<num_processes; w++) {
+            if (alive[w] and idle[w] and failure.empty() and not queue.empty()) {
+                in_hand[w] = queue.front();
+                queue.pop_front();
+                idle[w] = false;
+                // a failed write shows up as EOF on the result pipe
+                write_all(job_pipes[w], &in_hand[w], sizeof(int32_t));
+            }
+            running = running or in_hand[w] != -1;
+        }
+        if (not failure.empty() or (queue.empty() and not running)) {
+            int32_t stop = -1;
+            for (size_t w=0; w<num_processes; w++) {
+                if (alive[w] and idle[w]) {
+                    idle[w] = false;
+                    write_all(job_pipes[w], &stop, sizeof(stop));
+                }
+            }
+        }
+    }
+    if (failure.empty() and not queue.empty()) {
+        failure = fmt::format("evaluation: all workers died, {} runs left", queue.size());
+    }
+    stop_workers();
+    if (not failure.empty()) {
+        throw std::runtime_error(failure);
+    }
+}
+
 /* 
     Evaluation
     - also uses threads, so we should compile with "make fast"
-    - runs your dataset for different pb's and writes output to results/xy.csv
+    - runs your dataset for different pb's and writes output to results/evaluation/xy.csv
+    - all runs (budget, fold, repetition) are scheduled on the thread pool at
+      once, longest first, results are written as they come in
+    - with repetitions > 1 (Monte Carlo over the DP noise) a budget's scores are
+      aggregated online: mean/std (Welford), 95% CI of the mean, streaming
+      median and 2.5% / 97.5% quantiles
+    - with num_processes > 0 the runs are spread over forked worker processes
+      instead (see run_in_processes), for large sweeps
 */
 
 int Evaluation::main(int argc, char *argv[])
@@ -27,6 +321,9 @@ int Evaluation::main(int argc, char *argv[])
     spdlog::set_level(spdlog::level::err);
     spdlog::set_pattern("[%H:%M:%S] [%^%5l%$] %v");
 
+    // worker threads shared by folds, trees and features (0 = one per core)
+    ThreadPool::set_num_workers(0);
+
     std::vector<ModelParams> parameters;
 
     // --------------------------------------
@@ -43,93 +340,172 @@ int Evaluation::main(int argc, char *argv[])
     parameters.push_back(current_params);
     // --------------------------------------
     // select 1 dataset here
-    DataSet *dataset = Parser::get_abalone(parameters, 5000, false); // full abalone
-    // DataSet *dataset = Parser::get_adult(parameters, 5000, false);
-    // DataSet dataset = Parser::get_YearPredictionMSD(parameters, 10000, false);
+    std::shared_ptr<DataSet> dataset(Parser::get_abalone(parameters, 5000, false)); // full abalone
+    // std::shared_ptr<DataSet> dataset(Parser::get_adult(parameters, 5000, false));
+    // std::shared_ptr<DataSet> dataset(Parser::get_abalone_sex(parameters, 5000, false)); // multi-class
+    // std::shared_ptr<DataSet> dataset(Parser::get_YearPredictionMSD(parameters, 10000, false));
     // --------------------------------------
     // select privacy budgets
     // Note: pb=0 takes much much longer than dp-trees, because we're always using all samples
     std::vector<double> budgets = {0.1,0.2,0.3,0.4,0.5,0.6,0.7,0.8,0.9,1,1.5,2,2.5,3,4,5,6,7,8,9,10};
+    // repetitions of the 5-fold cv per budget, e.g. a few hundred to compare
+    // budgets/settings reliably. The folds stay the same, every run gets its
+    // own seed
+    int repetitions = 1;
+    // 0: all runs in this process on the thread pool, otherwise the number
+    // of worker processes (each gets its share of the cores)
+    size_t num_processes = 0;
+    // where the output files go (created if missing)
+    std::string results_dir = "results/evaluation";
     // --------------------------------------
 
-    // output file
+    // output files: one row per budget (mean/std over all its runs), and
+    // one per run, written as soon as the run is done
     std::string time_string = get_time_string();
     std::string dataset_name = dataset->name;
     int dataset_length = dataset->length;
-    std::string outfile_name = fmt::format("results/TODO_create_me/{}_{}.csv", dataset_name, time_string);
-    std::ofstream output;
-    output.open(outfile_name);
+    std::string outfile_name = fmt::format("{}/{}_{}.csv", results_dir, dataset_name, time_string);
+    std::string runs_file_name = fmt::format("{}/{}_{}_runs.csv", results_dir, dataset_name, time_string);
+    std::ofstream output, runs_output;
+    open_output_file(output, outfile_name);
+    open_output_file(runs_output, runs_file_name);
     std::cout << "evaluation, writing results to " << outfile_name << std::endl;
-    output << "dataset,nb_samples,nb_trees,use_dp,privacy_budget,mean,std,glc,gdf" << std::endl;
-
-    // currently we use the same folds for all budgets. Not sure whether that's good or bad.
+    output << "dataset,nb_samples,nb_trees,use_dp,privacy_budget,mean,std,glc,gdf,"
+        "runs,ci_low,ci_high,median,q025,q975" << std::endl;
+    runs_output << "dataset,nb_samples,nb_trees,use_dp,privacy_budget,fold,repetition,score,seconds" << std::endl;
 
-    ModelParams param = parameters[0];
+    // the dataset is loaded and split into folds once, all budgets train on
+    // the same folds. Training never modifies the shared data.
+    std::vector<TrainTestSplit *> cv_inputs = create_cross_validation_inputs(dataset, 5);
 
-    // run the evaluations
-    for(auto budget : budgets) {
+    // every (budget, fold, repetition) is a job on the thread pool
+    std::vector<ModelParams> budget_params;
+    for (auto budget : budgets) {
+        ModelParams param = parameters[0];
         param.privacy_budget = budget;
         param.use_dp = budget != 0.;
-        std::cout << dataset_name << " pb=" << budget << std::endl;
-
-        std::vector<TrainTestSplit *> cv_inputs = create_cross_validation_inputs(dataset, 5);
-
-        Timer time_begin = std::chrono::steady_clock::now();
-        
-        // prepare the ressources for each thread
-        std::vector<std::thread> threads(cv_inputs.size());
-        std::vector<DPEnsemble> ensembles;
-        for (auto split : cv_inputs) {
-            if(param.scale_y){
-                split->train.scale_y(param, -1, 1);
+        budget_params.push_back(param);
+    }
+    std::vector<EvaluationJob> jobs;
+    for (size_t b=0; b<budgets.size(); b++) {
+        for (size_t fold=0; fold<cv_inputs.size(); fold++) {
+            for (int rep=0; rep<repetitions; rep++) {
+                jobs.push_back({b, fold, rep, estimated_cost(budget_params[b], cv_inputs[fold]->train_indices().size()),
+                    (unsigned) std::rand()});
             }
-            ensembles.push_back(DPEnsemble(&param) );
         }
+    }
+    // longest first, so that no long job starts at the very end
+    std::stable_sort(jobs.begin(), jobs.end(),
+        [](const EvaluationJob &a, const EvaluationJob &b) { return a.cost > b.cost; });
+
+    std::mutex output_mutex;
+    std::vector<BudgetScores> scores(budgets.size());
+    size_t next_summary = 0;
+    size_t runs_per_budget = cv_inputs.size() * repetitions;
+
+    // trains and scores one run
+    auto run_job = [&](const EvaluationJob &job, double &seconds) {
+        Timer job_begin = std::chrono::steady_clock::now();
+        ModelParams param = budget_params[job.budget];
 
-        // threads start training on ther respective folds
-        for(size_t thread_id=0; thread_id<threads.size(); thread_id++){
-            threads[thread_id] = std::thread(&DPEnsemble::train, &ensembles[thread_id],
-                &(cv_inputs[thread_id]->train));
+        // own copy of the split, the scaling depends on the budget (dp or not)
+        TrainTestSplit split = *cv_inputs[job.fold];
+        if (param.scale_y) {
+            split.scale_y(param, -1, 1);
         }
-        for (auto &thread : threads) {
-            thread.join(); // join once done
+        RunContext context(job.seed);
+        DPEnsemble ensemble(&param, &context);
+        ensemble.train(&split);
+
+        // predict with the test set
+        std::vector<double> y_pred = ensemble.predict(split.X(), split.test_indices());
+        if (param.scale_y) {
+            inverse_scale_y(param, split.scaler, y_pred);
         }
+        std::vector<double> y_test = split.test_y();
+        double score = param.task->compute_score(y_test, y_pred);
+        seconds = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - job_begin).count() / 1000.;
+        return score;
+    };
 
-        /* compute scores */
+    // budgets go to the file in order (the plots rely on it), each as soon
+    // as all budgets before it are done. After a failure the complete ones
+    // are written, skipping those with missing runs
+    auto write_summaries = [&](bool skip_incomplete) {
+        for (; next_summary < budgets.size(); next_summary++) {
+            ModelParams &done = budget_params[next_summary];
+            BudgetScores &summary = scores[next_summary];
+            if (summary.stats.count() != runs_per_budget) {
+                if (not skip_incomplete) {
+                    break;
+                }
+                std::cerr << "pb=" << done.privacy_budget << ": only " << summary.stats.count() << " of "
+                    << runs_per_budget << " runs done, left out" << std::endl;
+                continue;
+            }
+            double mean = summary.stats.mean(), ci = summary.stats.ci95_half_width();
+            output << fmt::format("{},{},{},{},{},{},{},{},{},{},{},{},{},{},{}", dataset_name, dataset_length,
+                done.nb_trees, done.use_dp, done.privacy_budget, mean, summary.stats.stdev(), done.leaf_clipping,
+                done.gradient_filtering, summary.stats.count(), mean - ci, mean + ci, summary.median.value(),
+                summary.q025.value(), summary.q975.value()) << std::endl;
+        }
+    };
 
-        std::vector<double> scores;
-        for (size_t ensemble_id = 0; ensemble_id < ensembles.size(); ensemble_id++) {
-            DPEnsemble *ensemble = &ensembles[ensemble_id];
-            TrainTestSplit *split = cv_inputs[ensemble_id];
-            
-            // predict with the test set
-            std::vector<double> y_pred = ensemble->predict(split->test.X);
+    // writes a finished run and, once complete, its budget's summary
+    auto record = [&](const EvaluationJob &job, double score, double seconds) {
+        std::lock_guard<std::mutex> lock(output_mutex);
+        ModelParams &param = budget_params[job.budget];
+        runs_output << fmt::format("{},{},{},{},{},{},{},{},{}", dataset_name, dataset_length, param.nb_trees,
+            param.use_dp, param.privacy_budget, job.fold, job.repetition, score, seconds) << std::endl;
 
-            if(param.scale_y){
-                inverse_scale_y(param, split->train.scaler, y_pred);
-            }
+        BudgetScores &budget_scores = scores[job.budget];
+        budget_scores.add(score);
+        if (budget_scores.stats.count() == runs_per_budget) {
+            std::cout << dataset_name << " pb=" << param.privacy_budget << ": " << std::setprecision(9)
+                << budget_scores.stats.mean() << " +- " << budget_scores.stats.ci95_half_width() << std::endl;
+        }
+        write_summaries(false);
+    };
 
-            // compute score            
-            double score = param.task->compute_score(split->test.y, y_pred);
-            std::cout << std::setprecision(9) << score << " " << std::flush;
-            scores.push_back(score);
-            delete split;
-        } 
-
-        // print elapsed time
-        Timer time_end = std::chrono::steady_clock::now();
-        double elapsed = std::chrono::duration_cast<std::chrono::milliseconds> (time_end - time_begin).count();
-        std::cout << "  (" << std::fixed << std::setprecision(1) << elapsed/1000 << "s)" << std::endl;
-
-        // write mean score to file
-        double mean = compute_mean(scores);
-        double stdev = compute_stdev(scores, mean);
-        output << fmt::format("{},{},{},{},{},{},{},{},{}", dataset_name, dataset_length, param.nb_trees, param.use_dp,
-            param.privacy_budget, mean, stdev, param.leaf_clipping, param.gradient_filtering) << std::endl;
+    Timer time_begin = std::chrono::steady_clock::now();
+    bool failed = false;
+    try {
+        if (num_processes > 0) {
+            run_in_processes(jobs, num_processes, run_job, record);
+        } else {
+            TaskGroup runs;
+            for (auto job : jobs) {
+                runs.run([&, job]() {
+                    double seconds;
+                    double score;
+                    try {
+                        score = run_job(job, seconds);
+                    } catch (const std::exception &e) {
+                        throw std::runtime_error(fmt::format("evaluation run {} failed: {}", describe(job), e.what()));
+                    }
+                    record(job, score, seconds);
+                });
+            }
+            runs.wait();
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        failed = true;
+        std::lock_guard<std::mutex> lock(output_mutex);
+        write_summaries(true);
     }
 
-    delete dataset;
+    // print elapsed time
+    Timer time_end = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration_cast<std::chrono::milliseconds> (time_end - time_begin).count();
+    std::cout << "done (" << std::fixed << std::setprecision(1) << elapsed/1000 << "s)" << std::endl;
 
+    for (auto split : cv_inputs) {
+        delete split;
+    }
     output.close();
-    return 0;
-}
\ No newline at end of file
+    runs_output.close();
+    return failed ? 1 : 0;
+}
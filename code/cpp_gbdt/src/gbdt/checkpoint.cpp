@@ -0,0 +1,285 @@
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include "checkpoint.h"
+
+using namespace std;
+
+static const char CHECKPOINT_MAGIC[8] = {'D','P','G','B','C','K','P','T'};
+static const uint32_t CHECKPOINT_VERSION = 2;
+
+
+/** Encoding */
+
+template <typename T>
+static void put(vector<char> &buf, const T &value)
+{
+    const char *bytes = reinterpret_cast<const char *>(&value);
+    buf.insert(buf.end(), bytes, bytes + sizeof(T));
+}
+
+template <typename T>
+static void put_vector(vector<char> &buf, const vector<T> &vec)
+{
+    put(buf, (uint64_t) vec.size());
+    const char *bytes = reinterpret_cast<const char *>(vec.data());
+    buf.insert(buf.end(), bytes, bytes + vec.size() * sizeof(T));
+}
+
+// reads values back from a buffer, throws when running past its end
+class Decoder
+{
+public:
+    Decoder(const char *begin, const char *end) : pos(begin), end(end) {}
+
+    template <typename T>
+    T get()
+    {
+        T value;
+        take(&value, sizeof(T));
+        return value;
+    }
+
+    template <typename T>
+    vector<T> get_vector()
+    {
+        uint64_t size = get<uint64_t>();
+        if (size > (uint64_t) (end - pos) / sizeof(T)) {
+            throw std::runtime_error("checkpoint record is cut off");
+        }
+        vector<T> vec(size);
+        take(vec.data(), size * sizeof(T));
+        return vec;
+    }
+
+private:
+    const char *pos, *end;
+
+    void take(void *out, size_t bytes)
+    {
+        if (bytes > (size_t) (end - pos)) {
+            throw std::runtime_error("checkpoint record is cut off");
+        }
+        memcpy(out, pos, bytes);
+        pos += bytes;
+    }
+};
+
+uint64_t fnv1a(const char *data, size_t size, uint64_t hash)
+{
+    for (size_t i=0; i<size; i++) {
+        hash = (hash ^ (uint8_t) data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// size, payload, hash
+static vector<char> encode_round(const CheckpointRound &round)
+{
+    vector<char> payload;
+    put(payload, round.round);
+    put(payload, round.seed);
+    put(payload, (uint32_t) round.trees.size());
+    for (auto &tree : round.trees) {
+        put_vector(payload, tree);
+    }
+    put_vector(payload, round.used_rows);
+    put_vector(payload, round.tree_sums);
+    put(payload, round.best_valid_score);
+    put(payload, round.best_round);
+
+    vector<char> record;
+    record.reserve(payload.size() + 2 * sizeof(uint64_t));
+    put(record, (uint64_t) payload.size());
+    record.insert(record.end(), payload.begin(), payload.end());
+    put(record, fnv1a(payload.data(), payload.size()));
+    return record;
+}
+
+static CheckpointRound decode_round(const char *begin, const char *end)
+{
+    Decoder in(begin, end);
+    CheckpointRound round;
+    round.round = in.get<int32_t>();
+    round.seed = in.get<uint32_t>();
+    uint32_t num_trees = in.get<uint32_t>();
+    for (uint32_t k=0; k<num_trees; k++) {
+        round.trees.push_back(in.get_vector<FlatNode>());
+    }
+    round.used_rows = in.get_vector<uint8_t>();
+    round.tree_sums = in.get_vector<double>();
+    round.best_valid_score = in.get<double>();
+    round.best_round = in.get<int32_t>();
+    return round;
+}
+
+static bool write_all(int fd, const char *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t written = ::write(fd, data, size);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+
+/** Reading */
+
+CheckpointHeader make_checkpoint_header(uint32_t num_outputs, uint64_t num_rows, int nb_trees, int first_round,
+    uint64_t params_hash, uint64_t data_hash)
+{
+    CheckpointHeader header = {};
+    std::copy(CHECKPOINT_MAGIC, CHECKPOINT_MAGIC + sizeof(CHECKPOINT_MAGIC), header.magic);
+    header.version = CHECKPOINT_VERSION;
+    header.num_outputs = num_outputs;
+    header.num_rows = num_rows;
+    header.nb_trees = nb_trees;
+    header.first_round = first_round;
+    header.params_hash = params_hash;
+    header.data_hash = data_hash;
+    return header;
+}
+
+vector<CheckpointRound> read_checkpoint(const std::string &path, const CheckpointHeader &header, size_t &valid_size)
+{
+    vector<CheckpointRound> rounds;
+    valid_size = 0;
+    std::ifstream in(path, std::ios::binary);
+    if (not in) {
+        return rounds;
+    }
+    vector<char> file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (file.size() < sizeof(CheckpointHeader)) {
+        // crashed before the header was complete
+        return rounds;
+    }
+    if (memcmp(file.data(), &header, sizeof(CheckpointHeader)) != 0) {
+        CheckpointHeader found;
+        memcpy(&found, file.data(), sizeof(found));
+        string reason = found.params_hash != header.params_hash ? " (different parameters)"
+            : found.data_hash != header.data_hash ? " (different train data)" : "";
+        throw std::runtime_error("checkpoint " + path + " belongs to a different training run" + reason);
+    }
+
+    size_t pos = sizeof(CheckpointHeader);
+    valid_size = pos;
+    while (file.size() - pos >= 2 * sizeof(uint64_t)) {
+        uint64_t size;
+        memcpy(&size, file.data() + pos, sizeof(size));
+        if (size > file.size() - pos - 2 * sizeof(uint64_t)) {
+            break;
+        }
+        const char *payload = file.data() + pos + sizeof(uint64_t);
+        uint64_t hash;
+        memcpy(&hash, payload + size, sizeof(hash));
+        if (hash != fnv1a(payload, size)) {
+            break;
+        }
+        CheckpointRound round;
+        try {
+            round = decode_round(payload, payload + size);
+        } catch (const std::runtime_error &) {
+            break;
+        }
+        if (round.round != (int32_t) rounds.size() or round.trees.size() != header.num_outputs) {
+            break;
+        }
+        if (not rounds.empty()) {
+            vector<uint8_t>().swap(rounds.back().used_rows);
+            vector<double>().swap(rounds.back().tree_sums);
+        }
+        rounds.push_back(std::move(round));
+        pos += size + 2 * sizeof(uint64_t);
+        valid_size = pos;
+    }
+    return rounds;
+}
+
+
+/** Writing */
+
+// continues the file after its first valid_size bytes (0: starts a new one)
+CheckpointWriter::CheckpointWriter(const std::string &path, const CheckpointHeader &header, size_t valid_size)
+    : path(path)
+{
+    fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd == -1) {
+        throw std::runtime_error("can't open checkpoint " + path);
+    }
+    bool ok = ftruncate(fd, valid_size) == 0 and lseek(fd, 0, SEEK_END) != -1;
+    if (ok and valid_size == 0) {
+        ok = write_all(fd, reinterpret_cast<const char *>(&header), sizeof(header));
+    }
+    if (not ok or fdatasync(fd) != 0) {
+        close(fd);
+        throw std::runtime_error("can't write checkpoint " + path);
+    }
+    thread = std::thread(&CheckpointWriter::run, this);
+}
+
+// waits for the queued rounds to be written
+CheckpointWriter::~CheckpointWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    cv.notify_one();
+    thread.join();
+    close(fd);
+    if (not error.empty()) {
+        std::cout << "warning, " << error << std::endl;
+    }
+}
+
+
+// the round is encoded right away, writing it happens on the writer thread.
+// Throws if an earlier round couldn't be written.
+void CheckpointWriter::write(const CheckpointRound &round)
+{
+    vector<char> record = encode_round(round);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (not error.empty()) {
+            throw std::runtime_error(error);
+        }
+        queue.push_back(std::move(record));
+    }
+    cv.notify_one();
+}
+
+
+void CheckpointWriter::run()
+{
+    while (true) {
+        vector<char> record;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]() { return done or not queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            record = std::move(queue.front());
+            queue.pop_front();
+            if (not error.empty()) {
+                continue;
+            }
+        }
+        if (not write_all(fd, record.data(), record.size()) or fdatasync(fd) != 0) {
+            std::lock_guard<std::mutex> lock(mutex);
+            error = "writing checkpoint " + path + " failed: " + strerror(errno);
+        }
+    }
+}
@@ -5,9 +5,10 @@
 #include <random>
 #include <cmath>
 #include "data.h"
+#include "vector_math.h"
+#include "run_context.h"
 
 
-extern bool VERIFICATION_MODE;
 
 
 Scaler::Scaler(double min_val, double max_val, double fmin, double fmax, bool scaling_required) : data_min(min_val), data_max(max_val),
@@ -26,7 +27,7 @@ DataSet::DataSet()
 }
 
 
-DataSet::DataSet(VVD X, std::vector<double> y) : X(X), y(y)
+DataSet::DataSet(const VVF &X, std::vector<double> y, const std::vector<int> &cat_idx) : X(X, cat_idx), y(y)
 {
     if(X.size() != y.size()){
         std::stringstream message;
@@ -39,41 +40,162 @@ DataSet::DataSet(VVD X, std::vector<double> y) : X(X), y(y)
 }
 
 
-// scale y values to be in [lower,upper]
-void DataSet::scale_y(ModelParams &params, double lower, double upper)
+// split the rows into typed columns. categorical features have to be
+// label-encoded (0,1,2,..), they are stored as 8 or 16 bit codes.
+FeatureMatrix::FeatureMatrix(const VVF &rows, const std::vector<int> &cat_idx)
 {
-    // only scale in dp mode
-    if(params.use_dp or VERIFICATION_MODE){
-        
-        // return if no scaling required (y already in [-1,1])
-        bool scaling_required = false;
-        for(auto elem : y) {
-            if (elem < lower or elem > upper) {
-                scaling_required = true; break;
+    size_t num_rows = rows.size();
+    size_t cols = num_rows == 0 ? 0 : rows[0].size();
+    kind.resize(cols);
+    index.resize(cols);
+    values.resize(cols);
+
+    for (size_t col=0; col<cols; col++) {
+        bool categorical = std::find(cat_idx.begin(), cat_idx.end(), col) != cat_idx.end();
+        if (not categorical) {
+            kind[col] = NUMERICAL;
+            index[col] = numerical.size();
+            numerical.push_back(std::vector<feature_t>(num_rows));
+            for (size_t row=0; row<num_rows; row++) {
+                numerical.back()[row] = rows[row][col];
             }
-        }
-        if (not scaling_required) {
-            scaler = Scaler(0,0,0,0,false);
-            return;
+            continue;
         }
 
-        double doublemax = std::numeric_limits<double>::max();
-        double doublemin = std::numeric_limits<double>::min();
-        double minimum_y = doublemax, maximum_y = doublemin;
-        for(int i=0; i<length; i++) {
-            minimum_y = std::min(minimum_y, y[i]);
-            maximum_y = std::max(maximum_y, y[i]);
+        double max_code = 0;
+        for (size_t row=0; row<num_rows; row++) {
+            feature_t value = rows[row][col];
+            if (value < 0 or value > 65535 or value != std::floor(value)) {
+                std::stringstream message;
+                message << "categorical feature " << col << " is not label-encoded (value " << value << ")";
+                throw std::runtime_error(message.str());
+            }
+            max_code = std::max(max_code, (double) value);
+        }
+        values[col] = std::vector<double>(max_code + 1);
+        std::iota(values[col].begin(), values[col].end(), 0.0);
+        if (max_code <= 255) {
+            kind[col] = CATEGORICAL8;
+            index[col] = codes8.size();
+            codes8.push_back(std::vector<uint8_t>(num_rows));
+            for (size_t row=0; row<num_rows; row++) {
+                codes8.back()[row] = rows[row][col];
+            }
+        } else {
+            kind[col] = CATEGORICAL16;
+            index[col] = codes16.size();
+            codes16.push_back(std::vector<uint16_t>(num_rows));
+            for (size_t row=0; row<num_rows; row++) {
+                codes16.back()[row] = rows[row][col];
+            }
         }
-        for(int i=0; i<length; i++) {
-            y[i] = (y[i]- minimum_y)/(maximum_y-minimum_y) * (upper-lower) + lower;
+    }
+}
+
+
+// value of a feature, in units of the original X. For binned features
+// that's the lower edge of the row's bin, which leads to the same
+// decisions in the trees as the raw value.
+double FeatureMatrix::value(int row, int feature) const
+{
+    switch (kind[feature]) {
+        case NUMERICAL: return numerical[index[feature]][row];
+        case CATEGORICAL8: case BINNED8: return values[feature][codes8[index[feature]][row]];
+        default: return values[feature][codes16[index[feature]][row]];
+    }
+}
+
+
+// translate a code (split value of the tree builder) into the units of X
+double FeatureMatrix::code_value(int feature, double code) const
+{
+    return kind[feature] == NUMERICAL ? code : values[feature][(size_t) code];
+}
+
+
+void FeatureMatrix::swap_rows(int i, int j)
+{
+    for (auto &col : numerical) std::swap(col[i], col[j]);
+    for (auto &col : codes8) std::swap(col[i], col[j]);
+    for (auto &col : codes16) std::swap(col[i], col[j]);
+}
+
+
+template <typename T>
+static std::vector<T> gather(const std::vector<T> &col, const std::vector<int> &rows)
+{
+    std::vector<T> result(rows.size());
+    for (size_t i=0; i<rows.size(); i++) {
+        result[i] = col[rows[i]];
+    }
+    return result;
+}
+
+// copy of the given rows (in that order), e.g. the rows of one tree
+FeatureMatrix FeatureMatrix::gather_rows(const std::vector<int> &rows) const
+{
+    FeatureMatrix result;
+    result.kind = kind;
+    result.index = index;
+    result.values = values;
+    result.bin_privacy_budget = bin_privacy_budget;
+    for (auto &col : numerical) result.numerical.push_back(gather(col, rows));
+    for (auto &col : codes8) result.codes8.push_back(gather(col, rows));
+    for (auto &col : codes16) result.codes16.push_back(gather(col, rows));
+    return result;
+}
+
+
+// scale y values to be in [lower,upper]
+void DataSet::scale_y(ModelParams &params, double lower, double upper)
+{
+    // only scale in dp mode
+    if(params.use_dp){
+        scaler = compute_scaler(params, y, lower, upper);
+        ::scale_y(scaler, y);
+    }
+}
+
+
+// figure out how y has to be scaled to end up in [lower,upper]
+Scaler compute_scaler(ModelParams &params, std::vector<double> &y, double lower, double upper)
+{
+    // return if no scaling required (y already in [-1,1])
+    bool scaling_required = false;
+    for(auto elem : y) {
+        if (elem < lower or elem > upper) {
+            scaling_required = true; break;
         }
-        scaler = Scaler(minimum_y, maximum_y, lower, upper, true);
+    }
+    if (not params.use_dp or not scaling_required) {
+        return Scaler(0,0,0,0,false);
+    }
+
+    double doublemax = std::numeric_limits<double>::max();
+    double doublemin = std::numeric_limits<double>::min();
+    double minimum_y = doublemax, maximum_y = doublemin;
+    for(auto elem : y) {
+        minimum_y = std::min(minimum_y, elem);
+        maximum_y = std::max(maximum_y, elem);
+    }
+    return Scaler(minimum_y, maximum_y, lower, upper, true);
+}
+
+
+void scale_y(const Scaler &scaler, std::vector<double> &vec)
+{
+    if(not scaler.scaling_required){
+        return;
+    }
+    double lower = scaler.feature_min, upper = scaler.feature_max;
+    for(auto &elem : vec) {
+        elem = (elem - scaler.data_min)/(scaler.data_max - scaler.data_min) * (upper-lower) + lower;
     }
 }
 
 void inverse_scale_y(ModelParams &params, Scaler &scaler, std::vector<double> &vec)
 {
-    if(params.use_dp or VERIFICATION_MODE){
+    if(params.use_dp){
         // return if no scaling required
         if(not scaler.scaling_required){
             return;
@@ -90,97 +212,84 @@ void inverse_scale_y(ModelParams &params, Scaler &scaler, std::vector<double> &v
 //      https://arxiv.org/pdf/2001.02285.pdf
 // corresponding code:
 //  https://github.com/wxindu/dp-conf-int/blob/master/algorithms/alg5_EXPQ.R
-std::tuple<double,double> dp_confidence_interval(std::vector<double> &samples, double percentile, double budget)
+// One quantile of the (sorted) samples: the exponential mechanism picks one of the
+// intervals between neighbouring samples, weighted by its width and by how far its
+// rank is from the quantile's, then a value within it. EXPQ assumes a known range
+// of the data, the smallest and largest sample stand in for it.
+static double dp_quantile(const std::vector<double> &sorted, double quantile, double budget, RunContext &context)
 {
-    // e.g.  95% -> {0.025, 0.975}
-    std::vector<double> quantiles = {(1.0-percentile/100.)/2., percentile/100. + (1.0-percentile/100.)/2.};
-    std::vector<double> results;
+    int n = sorted.size();
+    if (n < 2) {
+        return n == 0 ? 0 : sorted[0];
+    }
+    double r = ((double)context.random.next()/(double)RAND_MAX);
+    if(context.verification) {
+        r = 0.5;
+    }
 
-    // set up inputs
-    std::sort(samples.begin(),samples.end());
-    double *db = samples.data();
-    int n = samples.size();
-    double e = budget / 2;  // half budget since we're doing it twice
-
-    // run the dp quantile calculation twice (to get the lower & upper bound)
-    for(auto quantile : quantiles) {
-
-        double q = quantile;
-        int qi = std::floor((n-1)*q + 1.5);
-        std::vector<double> probs(n+1);
-        std::iota(probs.begin(), probs.end(), 1.0);   // [1,2,...,n+1]
-        double r = ((double)std::rand()/(double)RAND_MAX);
-        if(VERIFICATION_MODE) {
-            r = 0.5;
-        }
-        int priv_qi;
-        
-        // exponential mechanism
-        // https://github.com/wxindu/dp-conf-int/blob/master/algorithms/exp_mech.c
-        int m = qi;
-        for(int i = 0; i < m; i++) {
-            double utility = (i + 1) - m;
-            probs[i] = std::max(0.0, (db[i + 1] - db[i]) * std::exp(e * utility / 2.));
-        }
-        for(int i = m; i <= n; i++) {
-            double utility = m - i;
-            probs[i] = std::max(0.0, (db[i + 1] - db[i]) * std::exp(e * utility / 2.));
-        }
-        double sum = 0;
-        for(int i = 0; i <= n; i++) sum += probs[i];
-        r *= sum;
-        for(int i = 0; i <= n; i++) {
-            r -= probs[i];
-            if(r < 0) {
-                priv_qi = i;
-                break;
-            }
-        }
-        std::uniform_real_distribution<double> unif(db[priv_qi],db[priv_qi+1]);
-        std::default_random_engine re;
-        double a_random_double = unif(re);
-        if(VERIFICATION_MODE){
-            a_random_double = db[priv_qi];
+    // interval i = [sorted[i], sorted[i+1]], ranks above the quantile's (m) and
+    // below it cost the same
+    int m = std::floor((n-1)*quantile + 0.5);
+    std::vector<double> probs(n-1);
+    for(int i = 0; i < n-1; i++) {
+        double utility = i < m ? (i + 1) - m : m - i;
+        probs[i] = budget * utility / 2.;
+    }
+    vexp(probs.data(), probs.data(), n-1, context.verification);
+    double sum = 0;
+    for(int i = 0; i < n-1; i++) {
+        probs[i] = std::max(0.0, (sorted[i + 1] - sorted[i]) * probs[i]);
+        sum += probs[i];
+    }
+    if (sum == 0) {
+        return sorted[m];   // all samples are equal
+    }
+    r *= sum;
+    int priv_i = n-2;
+    for(int i = 0; i < n-1; i++) {
+        r -= probs[i];
+        if(r < 0) {
+            priv_i = i;
+            break;
         }
-        results.push_back(a_random_double);
     }
-    return std::make_tuple(results[0],results[1]);
+    if(context.verification){
+        return sorted[priv_i];
+    }
+    double within = ((double)context.random.next()/(double)RAND_MAX);
+    return sorted[priv_i] + within * (sorted[priv_i + 1] - sorted[priv_i]);
+}
+
+// dp interval holding the central percentile% of the samples (half of the budget for each end)
+std::tuple<double,double> dp_confidence_interval(std::vector<double> &samples, double percentile, double budget,
+    RunContext &context)
+{
+    // e.g.  95% -> {0.025, 0.975}
+    double tail = (1.0-percentile/100.)/2.;
+    std::sort(samples.begin(),samples.end());
+    return std::make_tuple(dp_quantile(samples, tail, budget / 2, context),
+        dp_quantile(samples, 1.0 - tail, budget / 2, context));
 }
 
 
-TrainTestSplit train_test_split_random(DataSet &dataset, double train_ratio, bool shuffle)
+TrainTestSplit train_test_split_random(std::shared_ptr<DataSet> dataset, double train_ratio, bool shuffle)
 {
     if(shuffle) {
-        dataset.shuffle_dataset();
+        dataset->shuffle_dataset();
     }
 
     // [ test |      train      ]
-    int border = ceil((1-train_ratio) * dataset.y.size());
-
-    VVD x_test(dataset.X.begin(), dataset.X.begin() + border);
-    std::vector<double> y_test(dataset.y.begin(), dataset.y.begin() + border);
-    VVD x_train(dataset.X.begin() + border, dataset.X.end());
-    std::vector<double> y_train(dataset.y.begin() + border, dataset.y.end());
-
-    if(train_ratio >= 1) {
-        DataSet train(x_train, y_train);
-        return TrainTestSplit(train, DataSet());
-    } else if (train_ratio <= 0) {
-        DataSet test(x_test, y_test);
-        return TrainTestSplit(DataSet(), test);
-    } else {
-        DataSet train(x_train, y_train);
-        DataSet test(x_test, y_test);
-        return TrainTestSplit(train, test);
-    }
+    int border = ceil((1-train_ratio) * dataset->y.size());
+    border = std::max(0, std::min(border, dataset->length));
+    return TrainTestSplit(dataset, 0, border);
 }
 
 // "reverse engineered" the python sklearn.model_selection.cross_val_score
 // Returns a std::vector of the train-test-splits. Will by default shuffle 
 // the dataset rows, unless we're in verification mode.
-std::vector<TrainTestSplit *> create_cross_validation_inputs(DataSet *dataset, int folds)
+// The splits only hold index ranges, all of them share the one dataset.
+std::vector<TrainTestSplit *> create_cross_validation_inputs(std::shared_ptr<DataSet> dataset, int folds, bool shuffle)
 {
-    bool shuffle = !VERIFICATION_MODE;
     if(shuffle) {
         dataset->shuffle_dataset();
     }
@@ -204,94 +313,136 @@ std::vector<TrainTestSplit *> create_cross_validation_inputs(DataSet *dataset, i
     indices.pop_back();
 
     std::vector<TrainTestSplit *> splits;
-
     for(int i=0; i<folds; i++) {
+        splits.push_back(new TrainTestSplit(dataset, indices[i], indices[i] + fold_sizes[i]));
+    }
+    return splits;
+}
 
-        // don't waste memory by using local copies of the vectors.
-        // work directly on what will be used.
-        TrainTestSplit *split = new TrainTestSplit();
-        DataSet *train = &split->train;
-        DataSet *test = &split->test;
 
-        VVD::iterator x_iterator = (dataset->X).begin() + indices[i];
-        std::vector<double>::iterator y_iterator = (dataset->y).begin() + indices[i];
+TrainTestSplit::TrainTestSplit(std::shared_ptr<const DataSet> dataset, int test_begin, int test_end) :
+        dataset(dataset), test_begin(test_begin), test_end(test_end), scaler(0,0,0,0,false) {}
 
-        // extracting the test slice is easy
-        test->X = VVD(x_iterator, x_iterator + fold_sizes[i]);
-        test->y = std::vector<double>(y_iterator, y_iterator + fold_sizes[i]);
 
-        // building the train set from the remaining rows is slightly more tricky
-        // (if you don't want to waste memory)
-        if(i != 0){     // part before the test slice
-            train->X = VVD((dataset->X).begin(), (dataset->X).begin() + indices[i]);
-            train->y = std::vector<double>((dataset->y).begin(), (dataset->y).begin() + indices[i]);
-        }
-        if(i < folds-1){    //part after the test slice
-            for(int cur_row = indices[i+1]; cur_row < dataset->length; cur_row++){
-                train->X.push_back(dataset->X[cur_row]);
-                train->y.push_back(dataset->y[cur_row]);
-            }
-        }
-        // don't forget to add the meta information
-        train->length = train->X.size();
-        train->num_x_cols = train->X[0].size();
-        train->empty = false;
-        test->length = test->X.size();
-        test->num_x_cols = test->X[0].size();
-        test->empty = false;
-
-        splits.push_back(split);
-    }
-    return splits;
+// all rows outside of [test_begin, test_end), in dataset order
+std::vector<int> TrainTestSplit::train_indices() const
+{
+    std::vector<int> indices(dataset->length - (test_end - test_begin));
+    std::iota(indices.begin(), indices.begin() + test_begin, 0);
+    std::iota(indices.begin() + test_begin, indices.end(), test_end);
+    return indices;
 }
 
 
-void DataSet::shuffle_dataset()
+std::vector<int> TrainTestSplit::test_indices() const
 {
-    std::vector<int> indices(length);
-    std::iota(std::begin(indices), std::end(indices), 0);
-    std::random_shuffle(indices.begin(), indices.end());
-    DataSet copy = *this;
-    for(size_t i=0; i<indices.size(); i++){
-        X[i] = copy.X[indices[i]];
-        y[i] = copy.y[indices[i]];
-        if (not gradients.empty()) {
-            gradients[i] = copy.gradients[i];
-        }
-    }
+    std::vector<int> indices(test_end - test_begin);
+    std::iota(indices.begin(), indices.end(), test_begin);
+    return indices;
+}
+
+
+// (scaled) targets of the train rows
+std::vector<double> TrainTestSplit::train_y() const
+{
+    std::vector<double> y(dataset->y.begin(), dataset->y.begin() + test_begin);
+    y.insert(y.end(), dataset->y.begin() + test_end, dataset->y.end());
+    ::scale_y(scaler, y);
+    return y;
+}
+
+
+std::vector<double> TrainTestSplit::test_y() const
+{
+    return std::vector<double>(dataset->y.begin() + test_begin, dataset->y.begin() + test_end);
+}
+
+
+// the shared dataset stays untouched, we only remember how the train
+// targets need to be scaled (the ensemble does it on its own copy of y)
+void TrainTestSplit::scale_y(ModelParams &params, double lower, double upper)
+{
+    scaler = Scaler(0,0,0,0,false);
+    std::vector<double> y = train_y();
+    scaler = compute_scaler(params, y, lower, upper);
 }
 
 
-DataSet DataSet::get_subset(std::vector<int> &indices)
+// Fisher-Yates directly on the rows, no copy of the dataset needed (O(1) extra
+// memory). Uses the same swap sequence as std::random_shuffle, so the same
+// seed still results in the same order.
+void DataSet::shuffle_dataset()
 {
-    DataSet dataset;
-    for (int i=0; i<length; i++) {
-        if (std::find(indices.begin(), indices.end(), i) != indices.end()) {
-            dataset.X.push_back(X[i]);
-            dataset.y.push_back(y[i]);
-            dataset.gradients.push_back(gradients[i]);
+    bool has_gradients = not gradients.empty();
+    for (int i=1; i<length; i++) {
+        int j = std::rand() % (i + 1);
+        X.swap_rows(i, j);
+        std::swap(y[i], y[j]);
+        if (has_gradients) {
+            std::swap(gradients[i], gradients[j]);
         }
     }
-    dataset.length = dataset.y.size();
-    dataset.num_x_cols = dataset.X[0].size();
-    dataset.empty = false;
-    return dataset;
 }
 
 
-DataSet DataSet::remove_rows(std::vector<int> &indices)
+// Maps every numerical feature to at most max_bins integer codes (BINNED8 for
+// <= 256 bins, BINNED16 otherwise) and drops its raw values, once for all folds.
+// The bins are equally wide between the dp borders of the central percentile% of
+// the column (dp_confidence_interval), values outside go to the first/last bin.
+// So the split candidates only depend on the data through those borders, which
+// cost budget in total (sequential composition over the features, each row has
+// all of them). The trees of a dp model have that much less (bin_privacy_budget).
+// Categorical features are codes already, they stay as they are.
+void FeatureMatrix::bin(int max_bins, double percentile, double budget, RunContext &context)
 {
-    DataSet dataset;
-    for (int i=0; i<length; i++) {
-        if (std::find(indices.begin(), indices.end(), i) == indices.end()) {
-            dataset.X.push_back(X[i]);
-            dataset.y.push_back(y[i]);
-            dataset.gradients.push_back(gradients[i]);
+    if (max_bins < 2 or max_bins > 65536) {
+        throw std::runtime_error("max_bins needs to be in [2,65536]");
+    }
+    if (budget <= 0) {
+        throw std::runtime_error("binning the features needs a positive budget for the bin borders");
+    }
+    bool use_8bit = max_bins <= 256;
+    size_t num_numerical = std::count(kind.begin(), kind.end(), NUMERICAL);
+
+    for (size_t col=0; col<num_cols(); col++) {
+        if (kind[col] != NUMERICAL) {
+            continue;
+        }
+        std::vector<feature_t> &raw = numerical[index[col]];
+        size_t length = raw.size();
+        std::vector<double> sorted(raw.begin(), raw.end());
+        auto borders = dp_confidence_interval(sorted, percentile, budget / num_numerical, context);
+        double lower = std::get<0>(borders), upper = std::get<1>(borders);
+
+        std::vector<double> &edges = values[col];
+        edges.assign(1, lower);
+        for (int b=1; b<max_bins and upper > lower; b++) {
+            double edge = lower + b * (upper - lower) / max_bins;
+            if (edge > edges.back()) {
+                edges.push_back(edge);
+            }
+        }
+
+        // code = index of the last edge <= value
+        if (use_8bit) {
+            kind[col] = BINNED8;
+            codes8.push_back(std::vector<uint8_t>(length));
+        } else {
+            kind[col] = BINNED16;
+            codes16.push_back(std::vector<uint16_t>(length));
+        }
+        for (size_t row=0; row<length; row++) {
+            long code = std::upper_bound(edges.begin(), edges.end(), (double) raw[row]) - edges.begin() - 1;
+            code = std::max(0L, code);
+            if (use_8bit) {
+                codes8.back()[row] = code;
+            } else {
+                codes16.back()[row] = code;
+            }
         }
+        index[col] = use_8bit ? codes8.size() - 1 : codes16.size() - 1;
+        std::vector<feature_t>().swap(raw);
     }
-    dataset.length = dataset.y.size();
-    dataset.num_x_cols = X[0].size();
-    dataset.empty = dataset.length == 0;
-    dataset.scaler = scaler;
-    return dataset;
+    numerical.clear();
+    bin_privacy_budget = budget;
 }
@@ -2,25 +2,30 @@
 #include <algorithm>
 #include <mutex>
 #include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <cstdint>
+#include <sstream>
+#include <cstring>
 #include "dp_ensemble.h"
+#include "model_file.h"
+#include "checkpoint.h"
+#include "utils.h"
 #include "logging.h"
 #include "spdlog/spdlog.h"
 
-extern std::ofstream verification_logfile;
-extern size_t cv_fold_index;
-extern bool VERIFICATION_MODE;
-extern std::once_flag flag1;
-
 using namespace std;
 
+static std::once_flag dp_disabled_warning;
+
 
 /** Constructors */
 
-DPEnsemble::DPEnsemble(ModelParams *parameters) : params(parameters)
+DPEnsemble::DPEnsemble(ModelParams *parameters, RunContext *context) : params(parameters), context(context)
 {
     // only output this once, in case we're running with multiple threads
     if (parameters->privacy_budget == 0 or !parameters->use_dp){
-        std::call_once(flag1, [](){std::cout << "!!! DP disabled !!! (slower than dp!)" << std::endl;});
+        std::call_once(dp_disabled_warning, [](){std::cout << "!!! DP disabled !!! (slower than dp!)" << std::endl;});
         params->use_dp = false;
         params->privacy_budget = 0;
     }
@@ -33,32 +38,310 @@ DPEnsemble::~DPEnsemble() {
 }
 
 
+/** Helpers */
+
+// binary model files (layout in model_file.h)
+template <typename T>
+static void write_value(std::ostream &out, const T &value)
+{
+    out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T>
+static void write_vector(std::ostream &out, const vector<T> &vec)
+{
+    write_value(out, (uint64_t) vec.size());
+    out.write(reinterpret_cast<const char *>(vec.data()), vec.size() * sizeof(T));
+}
+
+template <typename T>
+static T read_value(std::istream &in)
+{
+    T value;
+    if (not in.read(reinterpret_cast<char *>(&value), sizeof(T))) {
+        throw std::runtime_error("model file is truncated");
+    }
+    return value;
+}
+
+template <typename T>
+static vector<T> read_vector(std::istream &in)
+{
+    uint64_t size = read_value<uint64_t>(in);
+    vector<T> vec;
+    // grow while reading, a corrupt size then can't trigger a huge allocation
+    const uint64_t block = 1 << 16;
+    for (uint64_t begin=0; begin<size; begin+=block) {
+        uint64_t count = std::min(block, size - begin);
+        vec.resize(begin + count);
+        if (not in.read(reinterpret_cast<char *>(vec.data() + begin), count * sizeof(T))) {
+            throw std::runtime_error("model file is truncated");
+        }
+    }
+    return vec;
+}
+
+static TaskId task_id(Task *task)
+{
+    if (dynamic_cast<Regression *>(task)) {
+        return REGRESSION;
+    } else if (dynamic_cast<BinaryClassification *>(task)) {
+        return BINARY_CLASSIFICATION;
+    } else if (dynamic_cast<MultiClassification *>(task)) {
+        return MULTI_CLASSIFICATION;
+    }
+    throw std::runtime_error("unknown task, can't be saved");
+}
+
+static std::shared_ptr<Task> make_task(uint32_t id, uint32_t num_outputs)
+{
+    switch (id) {
+        case REGRESSION: return std::shared_ptr<Task>(new Regression());
+        case BINARY_CLASSIFICATION: return std::shared_ptr<Task>(new BinaryClassification());
+        case MULTI_CLASSIFICATION: return std::shared_ptr<Task>(new MultiClassification(num_outputs));
+    }
+    throw std::runtime_error("model file has an unknown task");
+}
+
+static const char *task_name(TaskId id)
+{
+    const char *names[] = {"regression", "binary_classification", "multi_classification"};
+    return names[id];
+}
+
+// The params section of model files (native byte order, vectors are a uint64
+// size followed by the elements):
+//     int32 nb_trees, max_depth, min_samples_split, max_bins
+//     double privacy_budget, l2_threshold, l2_lambda
+//     uint8 use_dp, balance_partition, gradient_filtering, leaf_clipping, scale_y, use_decay
+//     vector<int32> cat_idx, num_idx
+static string params_section_of(const ModelParams &params)
+{
+    std::ostringstream params_out;
+    write_value(params_out, (int32_t) params.nb_trees);
+    write_value(params_out, (int32_t) params.max_depth);
+    write_value(params_out, (int32_t) params.min_samples_split);
+    write_value(params_out, (int32_t) params.max_bins);
+    write_value(params_out, params.privacy_budget);
+    write_value(params_out, params.l2_threshold);
+    write_value(params_out, params.l2_lambda);
+    for (bool flag : {params.use_dp, params.balance_partition, params.gradient_filtering,
+            params.leaf_clipping, params.scale_y, params.use_decay}) {
+        write_value(params_out, (uint8_t) flag);
+    }
+    write_vector(params_out, vector<int32_t>(params.cat_idx.begin(), params.cat_idx.end()));
+    write_vector(params_out, vector<int32_t>(params.num_idx.begin(), params.num_idx.end()));
+    return params_out.str();
+}
+
+// identifies the parameters of a checkpointed run: the params section plus
+// what only shapes training (task, learning rate, early stopping)
+static uint64_t params_hash(const ModelParams &params)
+{
+    std::ostringstream out;
+    out << params_section_of(params);
+    write_value(out, (uint32_t) task_id(params.task.get()));
+    write_value(out, params.learning_rate);
+    write_value(out, (int32_t) params.early_stop);
+    string bytes = out.str();
+    return fnv1a(bytes.data(), bytes.size());
+}
+
+// identifies the train data of a checkpointed run (binned features also by their
+// edges, they're drawn anew each time a dataset gets binned)
+static uint64_t data_hash(const vector<int> &rows, const vector<double> &y, const FeatureMatrix &X)
+{
+    uint64_t hash = fnv1a(reinterpret_cast<const char *>(rows.data()), rows.size() * sizeof(int));
+    for (auto &edges : X.values) {
+        hash = fnv1a(reinterpret_cast<const char *>(edges.data()), edges.size() * sizeof(double), hash);
+    }
+    return fnv1a(reinterpret_cast<const char *>(y.data()), y.size() * sizeof(double), hash);
+}
+
+// chunks of the GDF stage are only worth a thread beyond this many rows
+static const size_t GDF_MIN_CHUNK = 1 << 15;
+// rows per thread when running all trees over a set of rows
+static const size_t PREDICT_MIN_CHUNK = 1 << 12;
+
+// Splits the positions 0..n-1 by |gradient| <= threshold into remaining (passed)
+// and reject (filtered out), both in ascending order. Chunks of the rows are
+// processed in parallel: threshold test into a byte mask, count per chunk,
+// prefix sum of the counts -> each chunk knows where to write its positions.
+static void filter_gradients(const vector<double> &gradients, double threshold,
+    vector<int> &remaining, vector<int> &reject)
+{
+    size_t n = gradients.size();
+    size_t num_chunks = number_of_chunks(n, GDF_MIN_CHUNK);
+    vector<uint8_t> passed(n);
+    vector<size_t> chunk_counts(num_chunks + 1, 0);
+
+    parallel_for_chunks(n, num_chunks, [&](size_t chunk, size_t begin, size_t end) {
+        const double *grad = gradients.data();
+        uint8_t *mask = passed.data();
+        size_t count = 0;
+        for (size_t i=begin; i<end; i++) {
+            mask[i] = !(grad[i] < -threshold) & !(grad[i] > threshold);
+            count += mask[i];
+        }
+        chunk_counts[chunk + 1] = count;
+    });
+    std::partial_sum(chunk_counts.begin(), chunk_counts.end(), chunk_counts.begin());
+
+    remaining.resize(chunk_counts[num_chunks]);
+    reject.resize(n - chunk_counts[num_chunks]);
+    parallel_for_chunks(n, num_chunks, [&](size_t chunk, size_t begin, size_t end) {
+        size_t pass_pos = chunk_counts[chunk];
+        size_t reject_pos = begin - pass_pos;
+        for (size_t i=begin; i<end; i++) {
+            if (passed[i]) {
+                remaining[pass_pos++] = i;
+            } else {
+                reject[reject_pos++] = i;
+            }
+        }
+    });
+}
+
+// Fisher-Yates that stops after k draws: the first k entries are then a
+// uniformly chosen subset (in random order), the rest is left as is.
+static void partial_shuffle(vector<int> &vec, size_t k, Random &random)
+{
+    size_t n = vec.size();
+    for (size_t i=0; i<std::min(k, n); i++) {
+        size_t j = i + random.uniform(n - i);
+        std::swap(vec[i], vec[j]);
+    }
+}
+
+
 /** Methods */
 
-void DPEnsemble::train(DataSet *dataset)
-{   
-    this->dataset = dataset;
-    int original_length = dataset->length;
+// Train on the train rows of a cv fold (with the fold's target scaling)
+void DPEnsemble::train(TrainTestSplit *split)
+{
+    train(split->X(), split->train_indices(), split->train_y());
+}
 
-    // compute initial prediction
-    this->init_score = params->task->compute_init_score(dataset->y);
-    LOG_DEBUG("Training initialized with score: {1}", init_score);
 
-    // each tree gets the full pb, as they train on distinct data
+// Train on all rows of the dataset
+void DPEnsemble::train(const DataSet &dataset)
+{
+    vector<int> all_rows(dataset.length);
+    std::iota(all_rows.begin(), all_rows.end(), 0);
+    train(dataset.X, all_rows, dataset.y);
+}
+
+
+// Train on the given rows of train_X, train_y holds their targets. X is never
+// modified, so it can be shared by many ensembles (folds, threads, budgets).
+// The ensemble instead keeps its own list of unused rows and their gradients.
+// Training again discards the previous trees, unless params->warm_start is set:
+// then the existing trees and init score are kept and nb_trees more trees are
+// boosted on top of them. The new trees spend params->privacy_budget, on data
+// that overlaps with earlier training data the budgets add up.
+void DPEnsemble::train(const FeatureMatrix &train_X, const vector<int> &train_rows, const vector<double> &train_y)
+{
+    bool warm_start = params->warm_start and not trees.empty();
+    if (not warm_start) {
+        for (auto tree : trees) {
+            tree.delete_tree(tree.root_node);
+        }
+        trees.clear();
+    }
+    this->features = &train_X;
+    this->rows = train_rows;
+    this->y = train_y;
+    int original_length = rows.size();
+    train_positions.clear();
+
+    // multi-class: each round builds K trees (one per class) on the same rows.
+    // GDF is skipped there, a row would have to pass the filter on all K
+    // trees, which is very unlikely (same as the python implementation)
+    int K = params->task->num_outputs();
+    bool gdf = params->gradient_filtering and K == 1;
+
+    // rounds that already exist (warm start). A new tree's leaf clipping bound
+    // shrinks with its overall round, its share of the rows only depends on its
+    // position among the new trees.
+    int first_round = trees.size() / K;
+    if (warm_start) {
+        // the existing trees' outputs on the new rows, in one pass
+        tree_sums = tree_output_sums(*features, rows);
+        LOG_INFO("Warm start: continuing after {1} rounds", first_round);
+    } else {
+        // compute initial prediction (one per class)
+        this->init_score = params->task->compute_init_score(y);
+        LOG_DEBUG("Training initialized with score: {1}", fmt::join(init_score, ", "));
+        tree_sums.assign(rows.size() * K, 0);
+    }
+
+    // checkpoints: continue after the last round in the file, then append a
+    // round after every finished one (on the writer's thread). The rounds reseed
+    // the context's random numbers, so a resumed run continues with the same ones.
+    int start_round = 0;
+    std::unique_ptr<CheckpointWriter> checkpoint;
+    vector<CheckpointRound> resumed;
+    if (not params->checkpoint.empty()) {
+        CheckpointHeader header = make_checkpoint_header(K, original_length, params->nb_trees, first_round,
+            params_hash(*params), data_hash(rows, y, *features));
+        size_t valid_size;
+        resumed = read_checkpoint(params->checkpoint, header, valid_size);
+        train_positions.resize(original_length);
+        std::iota(train_positions.begin(), train_positions.end(), 0);
+        if (not resumed.empty()) {
+            start_round = resume(resumed, first_round);
+        }
+        checkpoint.reset(new CheckpointWriter(params->checkpoint, header, valid_size));
+    }
+
+    bool early_stopping = params->early_stop > 0 and valid_X != nullptr;
+    best_valid_score = std::numeric_limits<double>::infinity();
+    best_round = -1;
+    if (early_stopping) {
+        valid_sums = tree_output_sums(*valid_X, valid_rows);
+        if (warm_start) {
+            // new rounds have to beat the existing model
+            vector<double> predictions = valid_sums;
+            apply_learning_rate(predictions);
+            best_valid_score = params->task->compute_score(valid_y, predictions);
+        }
+        if (not resumed.empty()) {
+            best_valid_score = resumed.back().best_valid_score;
+            best_round = resumed.back().best_round;
+        }
+    }
+
+    // each round gets the full pb, as the rounds train on distinct data. The K trees
+    // of a round share their rows, and with softmax every row has a nonzero gradient
+    // for every class, so it influences the splits and leaves of all K trees.
+    // Sequential composition -> each of them gets pb / K. (the python implementation
+    // halves the budget instead, assuming a row only counts towards its own class)
+    // Binned features: their borders were computed on the same rows, with
+    // features->bin_privacy_budget (sequential composition as well).
+    double trees_privacy_budget = params->privacy_budget;
+    if (params->use_dp and features->bin_privacy_budget > 0) {
+        trees_privacy_budget -= features->bin_privacy_budget;
+        if (trees_privacy_budget <= 0) {
+            throw std::runtime_error(fmt::format("privacy_budget {} doesn't cover the bin borders ({})",
+                params->privacy_budget, features->bin_privacy_budget));
+        }
+    }
     TreeParams tree_params;
-    tree_params.tree_privacy_budget = params->privacy_budget;
+    tree_params.tree_privacy_budget = trees_privacy_budget / K;
     tree_params.delta_g = 0;
     tree_params.delta_v = 0;
+    // you can only "turn off" leaf clipping if GDF is enabled!
+    tree_params.leaf_clipping = params->leaf_clipping or !gdf;
     
     // train all trees
-    for(int tree_index = 0; tree_index < params->nb_trees;  tree_index++) {
+    for(int tree_index = start_round; tree_index < params->nb_trees;  tree_index++) {
  
-        if(VERIFICATION_MODE) {
-            VERIFICATION_LOG("Tree {0} CV-Ensemble {1}", tree_index, cv_fold_index);
+        if(context->verification) {
+            VERIFICATION_LOG(context, "Tree {0} CV-Ensemble {1}", tree_index, context->fold_index);
         }
 
          // update/init gradients
-        update_gradients(dataset->gradients, tree_index);
+        update_gradients(gradients, tree_index);
 
         if(params->use_dp){   // build a dp-tree
 
@@ -66,19 +349,18 @@ void DPEnsemble::train(DataSet *dataset)
             tree_params.delta_g = 3 * pow(params->l2_threshold, 2);
 
             // sensitivity for leaves
-            if (params->gradient_filtering && !params->leaf_clipping) {
-                // you can only "turn off" leaf clipping if GDF is enabled!
+            if (!tree_params.leaf_clipping) {
                 tree_params.delta_v = params->l2_threshold / (1 + params->l2_lambda);
             } else {
                 tree_params.delta_v = std::min((double) (params->l2_threshold / (1 + params->l2_lambda)),
-                        2 * params->l2_threshold * pow(1-params->learning_rate, tree_index));
+                        2 * params->l2_threshold * pow(1-params->learning_rate, first_round + tree_index));
             }
 
             // determine number of rows
             int number_of_rows = 0;
             if (params->balance_partition) {
                 // num_unused_rows / num_remaining_trees
-                number_of_rows = dataset->length / (params->nb_trees - tree_index);
+                number_of_rows = rows.size() / (params->nb_trees - tree_index);
             } else {
                 // line 8 of Algorithm 2 from DPBoost paper
                 number_of_rows = (original_length * params->learning_rate *
@@ -91,45 +373,34 @@ void DPEnsemble::train(DataSet *dataset)
                 }
             }
 
+            // positions (in rows) of the samples this tree gets
             vector<int> tree_indices;
 
             // gradient-based data filtering
-            if(params->gradient_filtering) {
+            if(gdf) {
                 std::vector<int> reject_indices, remaining_indices;
-                for (int i=0; i<dataset->length; i++) {
-                    double curr_grad = dataset->gradients[i];
-                    if (curr_grad < -params->l2_threshold or curr_grad > params->l2_threshold) {
-                        reject_indices.push_back(i);
-                    } else {
-                        remaining_indices.push_back(i);
-                    }
-                }
+                filter_gradients(gradients, params->l2_threshold, remaining_indices, reject_indices);
                 LOG_INFO("GDF: {1} of {2} rows fulfill gradient criterion",
-                    remaining_indices.size(), dataset->length);
+                    remaining_indices.size(), rows.size());
 
                 if ((size_t) number_of_rows <= remaining_indices.size()) {
                     // we have enough samples that were not filtered out
-                    if (!VERIFICATION_MODE) {
-                        std::random_shuffle(remaining_indices.begin(), remaining_indices.end());
-                    }
-                    for(int i=0; i<number_of_rows; i++){
-                        tree_indices.push_back(remaining_indices[i]);
+                    if (!context->verification) {
+                        partial_shuffle(remaining_indices, number_of_rows, context->random);
                     }
+                    tree_indices.assign(remaining_indices.begin(), remaining_indices.begin() + number_of_rows);
                 } else {
                     // we don't have enough -> take all samples that were not filtered out
                     // and fill up with randomly chosen and clipped filtered ones
-                    for(auto filtered : remaining_indices){
-                        tree_indices.push_back(filtered);
-                    }
-                    LOG_INFO("GDF: filling up with {1} rows (clipping those gradients)",
-                        number_of_rows - tree_indices.size());
-                    if (!VERIFICATION_MODE) {
-                        std::random_shuffle(reject_indices.begin(), reject_indices.end());
+                    tree_indices = remaining_indices;
+                    int missing = number_of_rows - tree_indices.size();
+                    LOG_INFO("GDF: filling up with {1} rows (clipping those gradients)", missing);
+                    if (!context->verification) {
+                        partial_shuffle(reject_indices, missing, context->random);
                     }
-                    int reject_index = 0;
-                    for(int i=tree_indices.size(); i<number_of_rows; i++){
-                        int curr_index = reject_indices[reject_index++];
-                        dataset->gradients[curr_index] = clamp(dataset->gradients[curr_index],
+                    for(int i=0; i<missing; i++){
+                        int curr_index = reject_indices[i];
+                        gradients[curr_index] = clamp(gradients[curr_index],
                             -params->l2_threshold, params->l2_threshold);
                         tree_indices.push_back(curr_index);
                     }
@@ -137,84 +408,524 @@ void DPEnsemble::train(DataSet *dataset)
             } else {
                 // no GDF, just randomly select <number_of_rows> rows.
                 // Note, this causes the leaves to be clipped after building the tree.
-                tree_indices = vector<int>(dataset->length);
+                tree_indices = vector<int>(rows.size());
                 std::iota(std::begin(tree_indices), std::end(tree_indices), 0);
-                if (!VERIFICATION_MODE) {
-                    std::random_shuffle(tree_indices.begin(), tree_indices.end());
+                if (!context->verification) {
+                    partial_shuffle(tree_indices, number_of_rows, context->random);
                 }
-                tree_indices = std::vector<int>(tree_indices.begin(), tree_indices.begin() + number_of_rows);
+                tree_indices.resize(number_of_rows);
             }
 
-            DataSet tree_dataset = dataset->get_subset(tree_indices);
+            // the tree sees its rows in dataset order
+            std::sort(tree_indices.begin(), tree_indices.end());
+            vector<int> tree_rows;
+            vector<vector<double>> tree_gradients(K);
+            for (auto index : tree_indices) {
+                tree_rows.push_back(rows[index]);
+            }
+            for (int k=0; k<K; k++) {
+                for (auto index : tree_indices) {
+                    tree_gradients[k].push_back(gradients[k * rows.size() + index]);
+                }
+            }
+            // reorder_rows: the round's tree(s) train on a contiguous copy of just
+            // their rows (X itself is shared, e.g. by concurrent folds)
+            const FeatureMatrix *tree_X = features;
+            FeatureMatrix tree_copy;
+            if (params->reorder_rows) {
+                tree_copy = features->gather_rows(tree_rows);
+                std::iota(tree_rows.begin(), tree_rows.end(), 0);
+                tree_X = &tree_copy;
+            }
             
             LOG_DEBUG(YELLOW("Tree {1:2d}: receives pb {2:.2f} and will train on {3} instances"),
-                    tree_index, tree_params.tree_privacy_budget, tree_dataset.length);
+                    tree_index, tree_params.tree_privacy_budget, tree_rows.size());
 
-            // build tree
-            LOG_INFO("Building dp-tree-{1} using {2} samples...", tree_index, tree_dataset.length);
-            DPTree tree = DPTree(params, &tree_params, &tree_dataset, tree_index);
-            // DPTree tree = DPTree(params, &tree_params, dataset, tree_index);
-            tree.fit();
-            trees.push_back(tree);
+            // build tree(s)
+            LOG_INFO("Building dp-tree-{1} using {2} samples...", tree_index, tree_rows.size());
+            vector<DPTree> round_trees;
+            for (int k=0; k<K; k++) {
+                round_trees.push_back(DPTree(params, context, &tree_params, tree_X, &tree_rows, &tree_gradients[k],
+                    first_round + tree_index));
+            }
+            fit_trees(round_trees, tree_rows.size());
 
             // remove rows
-            *dataset = dataset->remove_rows(tree_indices);
+            remove_rows(tree_indices);
 
         } else {  // build a non-dp tree
             
             LOG_DEBUG(YELLOW("Tree {1:2d}: receives pb {2:.2f} and will train on {3} instances"),
-                    tree_index, tree_params.tree_privacy_budget, dataset->length);
+                    tree_index, tree_params.tree_privacy_budget, rows.size());
 
-            // build tree
-            LOG_INFO("Building non-dp-tree {1} using {2} samples...", tree_index, dataset->length);
-            DPTree tree = DPTree(params, &tree_params, dataset, tree_index);
-            tree.fit();
-            trees.push_back(tree);
+            // build tree(s)
+            LOG_INFO("Building non-dp-tree {1} using {2} samples...", tree_index, rows.size());
+            vector<vector<double>> class_gradients(K > 1 ? K : 0);
+            vector<DPTree> round_trees;
+            for (int k=0; k<K; k++) {
+                const vector<double> *tree_gradients = &gradients;
+                if (K > 1) {
+                    class_gradients[k].assign(gradients.begin() + k * rows.size(),
+                        gradients.begin() + (k+1) * rows.size());
+                    tree_gradients = &class_gradients[k];
+                }
+                round_trees.push_back(DPTree(params, context, &tree_params, features, &rows, tree_gradients,
+                    first_round + tree_index));
+            }
+            fit_trees(round_trees, rows.size());
         }
 
         // print the tree if we are in debug mode
         if (spdlog::default_logger_raw()->level() <= spdlog::level::debug) {
-            trees.back().recursive_print_tree(trees.back().root_node);
+            for (int k=0; k<K; k++) {
+                trees[trees.size() - K + k].recursive_print_tree(trees[trees.size() - K + k].root_node);
+            }
+        }
+        LOG_INFO(YELLOW("Tree {1:2d} done. Instances left: {2}"), tree_index, rows.size());
+
+        if (early_stopping and check_early_stop(tree_index)) {
+            // only keep the trees up to the best round
+            size_t keep = (first_round + best_round + 1) * K;
+            for (size_t i=keep; i<trees.size(); i++) {
+                trees[i].delete_tree(trees[i].root_node);
+            }
+            trees.erase(trees.begin() + keep, trees.end());
+            LOG_INFO("Early stop after tree {1}, best validation score {2:.6f} at tree {3}",
+                tree_index, best_valid_score, best_round);
+            break;
+        }
+
+        if (checkpoint) {
+            write_checkpoint(*checkpoint, tree_index, original_length);
         }
-        LOG_INFO(YELLOW("Tree {1:2d} done. Instances left: {2}"), tree_index, dataset->length);
     }
 }
 
 
+// Rows of X (not used for training) to score the ensemble on after every round,
+// y in the same (scaled) units as the training targets. Early stopping only
+// happens if params->early_stop > 0. Note, the choice of the best round is
+// not differentially private w.r.t. the validation rows.
+void DPEnsemble::set_validation(const FeatureMatrix &X, const vector<int> &rows, const vector<double> &y)
+{
+    this->valid_X = &X;
+    this->valid_rows = rows;
+    this->valid_y = y;
+}
+
+
+// Adds the newest round's trees to the cached validation predictions (no full
+// re-predict) and scores them. Lower scores are better (RMSE, misclassification).
+// Returns true once the score hasn't improved for params->early_stop rounds.
+bool DPEnsemble::check_early_stop(int tree_index)
+{
+    int K = params->task->num_outputs();
+    size_t n = valid_rows.size();
+    for (int k=0; k<K; k++) {
+        vector<double> pred = trees[trees.size() - K + k].predict(*valid_X, valid_rows);
+        std::transform(pred.begin(), pred.end(), valid_sums.begin() + k * n,
+            valid_sums.begin() + k * n, std::plus<double>());
+    }
+    vector<double> predictions = valid_sums;
+    apply_learning_rate(predictions);
+    double score = params->task->compute_score(valid_y, predictions);
+    LOG_INFO("Tree {1}: validation score {2:.6f}", tree_index, score);
+
+    if (score < best_valid_score) {
+        best_valid_score = score;
+        best_round = tree_index;
+    }
+    return tree_index - best_round >= params->early_stop;
+}
+
+
 // Predict values from the ensemble of gradient boosted trees
-vector<double>  DPEnsemble::predict(VVD &X)
+// (multi-class: K blocks of X.size() values, see Task)
+vector<double>  DPEnsemble::predict(const VVF &X)
 {
-    vector<double> predictions(X.size(),0);
-    for (auto tree : trees) {
-        vector<double> pred = tree.predict(X);
+    int K = params->task->num_outputs();
+    size_t n = X.size();
+    vector<double> predictions(n * K, 0);
+    for (size_t i=0; i<trees.size(); i++) {
+        vector<double> pred = trees[i].predict(X);
         
-        std::transform(pred.begin(), pred.end(), 
-            predictions.begin(), predictions.begin(), std::plus<double>());
+        std::transform(pred.begin(), pred.end(), predictions.begin() + (i % K) * n,
+            predictions.begin() + (i % K) * n, std::plus<double>());
     }
+    apply_learning_rate(predictions);
+    return predictions;
+}
+
 
-    double innit_score = this->init_score;
+// Predict values for the given rows of X
+vector<double>  DPEnsemble::predict(const FeatureMatrix &X, const vector<int> &rows)
+{
+    vector<double> predictions = tree_output_sums(X, rows);
+    apply_learning_rate(predictions);
+    return predictions;
+}
+
+
+// sum of all trees' outputs for the given rows (K blocks). Chunks of the rows
+// run in parallel, each row still adds up its trees in order.
+vector<double> DPEnsemble::tree_output_sums(const FeatureMatrix &X, const vector<int> &rows)
+{
+    size_t K = params->task->num_outputs();
+    size_t n = rows.size();
+    vector<double> sums(n * K, 0);
+    size_t num_chunks = number_of_chunks(n, PREDICT_MIN_CHUNK);
+    parallel_for_chunks(n, num_chunks, [&](size_t, size_t begin, size_t end) {
+        vector<int> chunk_rows(rows.begin() + begin, rows.begin() + end);
+        for (size_t i=0; i<trees.size(); i++) {
+            vector<double> pred = trees[i].predict(X, chunk_rows);
+            std::transform(pred.begin(), pred.end(), sums.begin() + (i % K) * n + begin,
+                sums.begin() + (i % K) * n + begin, std::plus<double>());
+        }
+    });
+    return sums;
+}
+
+
+// sum of tree predictions -> ensemble prediction
+void DPEnsemble::apply_learning_rate(vector<double> &predictions)
+{
     double learning_rate = params->learning_rate;
-    std::transform(predictions.begin(), predictions.end(), predictions.begin(), 
+    size_t n = predictions.size() / init_score.size();
+    for (size_t k=0; k<init_score.size(); k++) {
+        double innit_score = this->init_score[k];
+        std::transform(predictions.begin() + k * n, predictions.begin() + (k+1) * n,
+            predictions.begin() + k * n,
             [learning_rate, innit_score](double &c){return c*learning_rate + innit_score;});
+    }
+}
 
-    return predictions;
+
+// fits the K trees of a round (on num_rows rows each) concurrently (one after the
+// other in verification mode, to keep the log deterministic) and appends them to
+// the ensemble in class order. Each tree draws from its own random numbers, seeded
+// from the context's in class order, so seeded runs don't depend on the scheduling.
+void DPEnsemble::fit_trees(vector<DPTree> &round_trees, size_t num_rows)
+{
+    vector<Random> randoms(round_trees.size());
+    for (auto &random : randoms) {
+        random.seed(context->random.next());
+    }
+    size_t num_threads = context->verification ? 1 : round_trees.size();
+    parallel_for_chunks(round_trees.size(), num_threads, [&round_trees, &randoms](size_t, size_t begin, size_t end) {
+        for (size_t k=begin; k<end; k++) {
+            round_trees[k].fit(randoms[k]);
+        }
+    });
+    trees.insert(trees.end(), round_trees.begin(), round_trees.end());
+    context->metrics.trees += round_trees.size();
+    context->metrics.tree_rows += round_trees.size() * num_rows;
 }
 
 
 void DPEnsemble::update_gradients(vector<double> &gradients, int tree_index)
 {
+    // only the newest tree(s) need to be evaluated, the outputs of the
+    // previous ones are cached in tree_sums
+    int K = params->task->num_outputs();
+    vector<double> tree_pred;
     if(tree_index == 0) {
-        // init gradients
-        vector<double> init_scores(dataset->length, init_score);
-        gradients = params->task->compute_gradients(dataset->y, init_scores);
+        // init gradients (tree_sums are set up by train)
+        tree_pred.assign(rows.size() * K, 0);
     } else { 
         // update gradients
-        vector<double> y_pred = predict(dataset->X);
-        gradients = (params->task)->compute_gradients(dataset->y, y_pred);
+        for (size_t i=trees.size()-K; i<trees.size(); i++) {
+            vector<double> pred = trees[i].predict(*features, rows);
+            tree_pred.insert(tree_pred.end(), pred.begin(), pred.end());
+        }
     }
-    if(VERIFICATION_MODE) {
+    params->task->update_gradients(y, tree_sums, tree_pred, params->learning_rate,
+        init_score, gradients, context->verification);
+    if(context->verification) {
         double sum = std::accumulate(gradients.begin(), gradients.end(), 0.0);
         sum = sum < 0 && sum >= -1e-10 ? 0 : sum;  // avoid "-0.00000.. != 0.00000.."
-        VERIFICATION_LOG("GRADIENTSUM {0:.8f}", sum);
+        VERIFICATION_LOG(context, "GRADIENTSUM {0:.8f}", sum);
+    }
+}
+
+
+// drop the rows at the given (sorted) positions, keeps the order of the others.
+// gradients and tree_sums are compacted block by block (K blocks), moving a block
+// forward then never overwrites values that are still needed
+void DPEnsemble::remove_rows(vector<int> &positions)
+{
+    size_t n = rows.size();
+    size_t kept = n - positions.size();
+    size_t K = params->task->num_outputs();
+    for (size_t k=0; k<K; k++) {
+        size_t next = 0, to = k * kept;
+        for (size_t i=0; i<n; i++) {
+            if (next < positions.size() and (size_t) positions[next] == i) {
+                next++;
+                continue;
+            }
+            if (k == 0) {
+                rows[to] = rows[i];
+                y[to] = y[i];
+                if (not train_positions.empty()) {
+                    train_positions[to] = train_positions[i];
+                }
+            }
+            gradients[to] = gradients[k * n + i];
+            tree_sums[to] = tree_sums[k * n + i];
+            to++;
+        }
+    }
+    rows.resize(kept);
+    y.resize(kept);
+    if (not train_positions.empty()) {
+        train_positions.resize(kept);
+    }
+    gradients.resize(kept * K);
+    tree_sums.resize(kept * K);
+}
+
+
+// queues the state after the given round: its trees, which train rows were
+// used, the cached tree outputs and a new seed for the context's random numbers
+void DPEnsemble::write_checkpoint(CheckpointWriter &checkpoint, int tree_index, size_t num_train_rows)
+{
+    size_t K = params->task->num_outputs();
+    CheckpointRound round;
+    round.round = tree_index;
+    round.seed = context->random.next();
+    context->random.seed(round.seed);
+    for (size_t i=trees.size()-K; i<trees.size(); i++) {
+        round.trees.push_back(trees[i].flatten());
+    }
+    round.used_rows.assign((num_train_rows + 7) / 8, 0xff);
+    for (auto position : train_positions) {
+        round.used_rows[position / 8] &= ~(1 << (position % 8));
+    }
+    round.tree_sums = tree_sums;
+    round.best_valid_score = best_valid_score;
+    round.best_round = best_round;
+    checkpoint.write(round);
+}
+
+
+// restores the trees and the unused rows of a checkpoint (rows, y and
+// train_positions still hold all train rows). Returns the next round.
+int DPEnsemble::resume(const vector<CheckpointRound> &rounds, int first_round)
+{
+    const CheckpointRound &last = rounds.back();
+    size_t num_train_rows = rows.size();
+    vector<int> unused_rows;
+    vector<double> unused_y;
+    vector<int> unused_positions;
+    if (last.used_rows.size() != (num_train_rows + 7) / 8) {
+        throw std::runtime_error("checkpoint doesn't match the train rows");
+    }
+    for (size_t i=0; i<num_train_rows; i++) {
+        if (not ((last.used_rows[i / 8] >> (i % 8)) & 1)) {
+            unused_rows.push_back(rows[i]);
+            unused_y.push_back(y[i]);
+            unused_positions.push_back(i);
+        }
+    }
+    if (last.tree_sums.size() != unused_rows.size() * params->task->num_outputs()) {
+        throw std::runtime_error("checkpoint doesn't match the train rows");
+    }
+
+    for (auto &round : rounds) {
+        for (auto &nodes : round.trees) {
+            DPTree tree(params, context, nullptr, nullptr, nullptr, nullptr, first_round + round.round);
+            tree.from_flat(nodes.data(), nodes.size());
+            trees.push_back(tree);
+        }
+    }
+    rows = unused_rows;
+    y = unused_y;
+    train_positions = unused_positions;
+    tree_sums = last.tree_sums;
+    context->random.seed(last.seed);
+    LOG_INFO("Resuming from checkpoint after tree {1}, {2} rows left", last.round, rows.size());
+    return last.round + 1;
+}
+
+
+// Writes the model in the layout described in model_file.h, with the params
+// section of params_section_of.
+void DPEnsemble::save(const std::string &path)
+{
+    int K = params->task->num_outputs();
+    ModelFileHeader header = {};
+    std::copy(MODEL_MAGIC, MODEL_MAGIC + sizeof(MODEL_MAGIC), header.magic);
+    header.version = MODEL_VERSION;
+    header.task = task_id(params->task.get());
+    header.num_outputs = K;
+    header.num_trees = trees.size();
+    header.learning_rate = params->learning_rate;
+
+    string params_section = params_section_of(*params);
+
+    // all trees' nodes in one array
+    vector<uint64_t> tree_offsets = {0};
+    vector<FlatNode> nodes;
+    for (auto &tree : trees) {
+        vector<FlatNode> tree_nodes = tree.flatten();
+        nodes.insert(nodes.end(), tree_nodes.begin(), tree_nodes.end());
+        tree_offsets.push_back(nodes.size());
+    }
+
+    // features the trees split on
+    int num_features = 0;
+    for (auto &node : nodes) {
+        num_features = std::max(num_features, node.left == -1 ? 0 : node.split_attr + 1);
+    }
+    vector<uint8_t> categorical(num_features, 0);
+    for (int col : params->cat_idx) {
+        if (col < num_features) {
+            categorical[col] = 1;
+        }
+    }
+    header.num_features = num_features;
+
+    uint64_t offset = sizeof(header);
+    auto place = [&offset](uint64_t bytes, uint64_t alignment) {
+        offset = (offset + alignment - 1) / alignment * alignment;
+        uint64_t begin = offset;
+        offset += bytes;
+        return begin;
+    };
+    header.params_offset = place(params_section.size(), 8);
+    header.params_size = params_section.size();
+    header.init_score_offset = place(K * sizeof(double), 8);
+    header.categorical_offset = place(categorical.size(), 8);
+    header.tree_offsets_offset = place(tree_offsets.size() * sizeof(uint64_t), 8);
+    header.nodes_offset = place(nodes.size() * sizeof(FlatNode), 64);
+    header.file_size = offset;
+
+    vector<char> file(header.file_size, 0);
+    memcpy(file.data(), &header, sizeof(header));
+    memcpy(file.data() + header.params_offset, params_section.data(), params_section.size());
+    memcpy(file.data() + header.init_score_offset, init_score.data(), K * sizeof(double));
+    memcpy(file.data() + header.categorical_offset, categorical.data(), categorical.size());
+    memcpy(file.data() + header.tree_offsets_offset, tree_offsets.data(), tree_offsets.size() * sizeof(uint64_t));
+    memcpy(file.data() + header.nodes_offset, nodes.data(), nodes.size() * sizeof(FlatNode));
+
+    std::ofstream out(path, std::ios::binary);
+    if (not out or not out.write(file.data(), file.size())) {
+        throw std::runtime_error("failed writing model file " + path);
+    }
+}
+
+
+// Replaces this ensemble with the saved one. The ModelParams this ensemble was
+// constructed with stay untouched (they may be shared): from here on it uses its
+// own copy of them, with the model-defining fields (task, learning rate, the
+// params section) taken from the file. Runtime settings like warm_start,
+// checkpoint, early_stop and reorder_rows keep the caller's values, they can
+// be changed through parameters().
+void DPEnsemble::load(const std::string &path)
+{
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (not in) {
+        throw std::runtime_error("can't read model file " + path);
+    }
+    size_t size = in.tellg();
+    vector<uint64_t> buffer((size + 7) / 8);    // 8 byte aligned
+    const char *data = reinterpret_cast<const char *>(buffer.data());
+    in.seekg(0);
+    if (not in.read(reinterpret_cast<char *>(buffer.data()), size)) {
+        throw std::runtime_error("can't read model file " + path);
+    }
+    const ModelFileHeader *header;
+    try {
+        header = check_model_file(data, size);
+    } catch (const std::runtime_error &error) {
+        throw std::runtime_error(path + ": " + error.what());
+    }
+    uint32_t num_outputs = header->num_outputs;
+
+    std::istringstream params_in(string(data + header->params_offset, header->params_size));
+    ModelParams loaded = *params;
+    loaded.task = make_task(header->task, num_outputs);
+    loaded.learning_rate = header->learning_rate;
+    loaded.nb_trees = read_value<int32_t>(params_in);
+    loaded.max_depth = read_value<int32_t>(params_in);
+    loaded.min_samples_split = read_value<int32_t>(params_in);
+    loaded.max_bins = read_value<int32_t>(params_in);
+    loaded.privacy_budget = read_value<double>(params_in);
+    loaded.l2_threshold = read_value<double>(params_in);
+    loaded.l2_lambda = read_value<double>(params_in);
+    for (bool *flag : {&loaded.use_dp, &loaded.balance_partition, &loaded.gradient_filtering,
+            &loaded.leaf_clipping, &loaded.scale_y, &loaded.use_decay}) {
+        *flag = read_value<uint8_t>(params_in) != 0;
+    }
+    vector<int32_t> cat_idx = read_vector<int32_t>(params_in), num_idx = read_vector<int32_t>(params_in);
+    loaded.cat_idx.assign(cat_idx.begin(), cat_idx.end());
+    loaded.num_idx.assign(num_idx.begin(), num_idx.end());
+
+    const double *loaded_init_score = reinterpret_cast<const double *>(data + header->init_score_offset);
+    const uint64_t *tree_offsets = reinterpret_cast<const uint64_t *>(data + header->tree_offsets_offset);
+    const FlatNode *nodes = reinterpret_cast<const FlatNode *>(data + header->nodes_offset);
+    vector<DPTree> loaded_trees;
+    try {
+        for (uint64_t i=0; i<header->num_trees; i++) {
+            DPTree tree(&loaded_params, context, nullptr, nullptr, nullptr, nullptr, i / num_outputs);
+            tree.from_flat(nodes + tree_offsets[i], tree_offsets[i+1] - tree_offsets[i]);
+            loaded_trees.push_back(tree);
+        }
+    } catch (...) {
+        for (auto &tree : loaded_trees) {
+            tree.delete_tree(tree.root_node);
+        }
+        throw;
+    }
+
+    // all read, replace the current model
+    for (auto &tree : trees) {
+        tree.delete_tree(tree.root_node);
+    }
+    trees = loaded_trees;
+    init_score.assign(loaded_init_score, loaded_init_score + num_outputs);
+    loaded_params = loaded;
+    params = &loaded_params;
+}
+
+
+// human readable version of the saved model, for debugging
+void DPEnsemble::dump_json(std::ostream &out)
+{
+    auto int_list = [](const vector<int> &vec) { return fmt::format("[{}]", fmt::join(vec, ", ")); };
+
+    out << "{\n";
+    out << fmt::format("  \"version\": {},\n", MODEL_VERSION);
+    out << fmt::format("  \"task\": \"{}\",\n", task_name(task_id(params->task.get())));
+    out << fmt::format("  \"num_outputs\": {},\n", params->task->num_outputs());
+    out << "  \"params\": {\n";
+    out << fmt::format("    \"nb_trees\": {}, \"max_depth\": {}, \"min_samples_split\": {}, \"max_bins\": {},\n",
+        params->nb_trees, params->max_depth, params->min_samples_split, params->max_bins);
+    out << fmt::format("    \"learning_rate\": {}, \"privacy_budget\": {}, \"l2_threshold\": {}, \"l2_lambda\": {},\n",
+        params->learning_rate, params->privacy_budget, params->l2_threshold, params->l2_lambda);
+    out << fmt::format("    \"use_dp\": {}, \"balance_partition\": {}, \"gradient_filtering\": {}, "
+        "\"leaf_clipping\": {}, \"scale_y\": {}, \"use_decay\": {},\n", params->use_dp,
+        params->balance_partition, params->gradient_filtering, params->leaf_clipping, params->scale_y,
+        params->use_decay);
+    out << fmt::format("    \"cat_idx\": {}, \"num_idx\": {}\n", int_list(params->cat_idx), int_list(params->num_idx));
+    out << "  },\n";
+    out << fmt::format("  \"init_score\": [{}],\n", fmt::join(init_score, ", "));
+    out << "  \"trees\": [";
+    for (size_t t=0; t<trees.size(); t++) {
+        out << (t == 0 ? "\n" : ",\n") << "    [";
+        vector<FlatNode> nodes = trees[t].flatten();
+        for (size_t i=0; i<nodes.size(); i++) {
+            const FlatNode &node = nodes[i];
+            out << (i == 0 ? "\n" : ",\n");
+            if (node.left == -1) {
+                out << fmt::format("      {{\"depth\": {}, \"prediction\": {}}}", node.depth, node.prediction);
+            } else {
+                out << fmt::format("      {{\"depth\": {}, \"split_attr\": {}, \"split_value\": {}, "
+                    "\"left\": {}, \"right\": {}}}", node.depth, node.split_attr, node.split_value,
+                    node.left, node.right);
+            }
+        }
+        out << "\n    ]";
     }
+    out << "\n  ]\n}\n";
 }
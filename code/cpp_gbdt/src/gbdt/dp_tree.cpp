@@ -3,43 +3,66 @@
 #include <iomanip>
 #include <set>
 #include <cmath>
+#include <stdexcept>
 #include "dp_tree.h"
 #include "laplace.h"
+#include "vector_math.h"
 #include "logging.h"
 #include "spdlog/spdlog.h"
 
-extern std::ofstream verification_logfile;
-extern bool VERIFICATION_MODE;
+// the features of a node are scanned in parallel beyond this many (live rows * features)
+static const size_t SPLIT_MIN_WORK = 1 << 12;
 
 using namespace std;
 
 
 /** Constructors */
 
-DPTree::DPTree(ModelParams *params, TreeParams *tree_params, DataSet *dataset, size_t tree_index): 
+DPTree::DPTree(ModelParams *params, RunContext *context, TreeParams *tree_params, const FeatureMatrix *features,
+        const std::vector<int> *rows, const std::vector<double> *gradients, size_t tree_index): 
     params(params),
+    context(context),
     tree_params(tree_params), 
-    dataset(dataset),
-    tree_index(tree_index) {}
+    features(features),
+    rows(rows),
+    gradients(gradients),
+    tree_index(tree_index),
+    random(nullptr) {}
 
 DPTree::~DPTree() {}
 
 
 /** Methods */
 
-// Fit the tree to the data
-void DPTree::fit()
+// Fit the tree to the data, with the builder of the run's mode. The splits and
+// the leaf noise are drawn from random (not the context's, which the other trees
+// of the round would draw from concurrently)
+void DPTree::fit(Random &random)
+{
+    this->random = &random;
+    if (context->verification) {
+        params->use_dp ? build<VerificationBuild>() : build<NonDPVerificationBuild>();
+    } else {
+        params->use_dp ? build<DPBuild>() : build<NonDPBuild>();
+    }
+    this->random = nullptr;
+}
+
+
+template <typename Policy>
+void DPTree::build()
 {
     // keep track which samples will be available in a node for spliting
-    vector<int> live_samples(dataset->length);
+    // (positions in rows / gradients)
+    vector<int> live_samples(rows->size());
     std::iota(std::begin(live_samples), std::end(live_samples), 0);
 
-    this->root_node = make_tree_DFS(0, live_samples);
+    this->root_node = make_tree_DFS<Policy>(0, live_samples);
 
-    if(params->use_dp) {
+    if(Policy::use_dp) {
 
         // leaf clipping. Note, it can only be disabled if GDF is enabled.
-        if (params->leaf_clipping or !params->gradient_filtering) {
+        if (tree_params->leaf_clipping) {
             double threshold = params->l2_threshold * std::pow((1 - params->learning_rate), tree_index);
             for (auto &leaf : this->leaves) {
                 leaf->prediction = clamp(leaf->prediction, -threshold, threshold);
@@ -49,12 +72,13 @@ void DPTree::fit()
         // add laplace noise to leaf values
         double privacy_budget_for_leaf_nodes = tree_params->tree_privacy_budget  / 2;
         double laplace_scale = tree_params->delta_v / privacy_budget_for_leaf_nodes;
-        add_laplacian_noise(laplace_scale);
+        add_laplacian_noise<Policy>(laplace_scale);
     }
 }
 
 
 // Recursively build tree, DFS approach, first instance returns root node
+template <typename Policy>
 TreeNode *DPTree::make_tree_DFS(int current_depth, vector<int> live_samples)
 {
     // max depth reached or not enough samples -> leaf node
@@ -66,39 +90,33 @@ TreeNode *DPTree::make_tree_DFS(int current_depth, vector<int> live_samples)
         return leaf;
     }
 
-    // get the samples (and their gradients) that actually end up in this node
-    // note that the cols of X are rows in X_live
-    VVD X_live;
+    // get the gradients of the samples that actually end up in this node
     vector<double> gradients_live;
-    for(int col=0; col < dataset->num_x_cols; col++) {
-        vector<double> temp;    
-        for (auto elem : live_samples) {
-            temp.push_back((dataset->X)[elem][col]);
-        }
-        X_live.push_back(temp);
-    }
     for(auto elem : live_samples) {
-        gradients_live.push_back((dataset->gradients)[elem]);
+        gradients_live.push_back((*gradients)[elem]);
     }
 
     // find best split
-    TreeNode *node = find_best_split(X_live, gradients_live, current_depth);
+    TreeNode *node = find_best_split<Policy>(live_samples, gradients_live, current_depth);
 
-    // no split found
+    // no split found -> regular leaf (it needs a prediction, like in python)
     if (node->is_leaf()) {
         LOG_DEBUG("no split found -> leaf");
-        return node;
+        delete node;
+        return make_leaf_node(current_depth, live_samples);
     }
 
+    // the split value is a code for categorical/binned features, the node
+    // gets the corresponding value in units of X
+    double split_value = node->split_value;
+    node->split_value = features->code_value(node->split_attr, split_value);
+
     LOG_DEBUG("best split @ {1}, val {2:.2f}, gain {3:.5f}, curr_depth {4}, samples {5} ->({6},{7})", 
         node->split_attr, node->split_value, node->split_gain, current_depth, 
         node->lhs_size + node->rhs_size, node->lhs_size, node->rhs_size);
 
     // prepare the new live samples to continue recursion
-    vector<int> lhs;
-    bool categorical = std::find((params->cat_idx).begin(), (params->cat_idx).end(),
-            node->split_attr) != (params->cat_idx).end();
-    samples_left_right_partition(lhs, X_live, node->split_attr, node->split_value, categorical);
+    vector<int> lhs = partition(live_samples, node->split_attr, split_value);
     vector<int> left_live_samples, right_live_samples;
     for (size_t i=0; i<live_samples.size(); i++) {
         if (lhs[i]) {
@@ -108,36 +126,86 @@ TreeNode *DPTree::make_tree_DFS(int current_depth, vector<int> live_samples)
         }
     }
 
-    node->left = make_tree_DFS(current_depth + 1, left_live_samples);
-    node->right = make_tree_DFS(current_depth + 1, right_live_samples);
+    node->left = make_tree_DFS<Policy>(current_depth + 1, left_live_samples);
+    node->right = make_tree_DFS<Policy>(current_depth + 1, right_live_samples);
 
     return node;
 }
 
 
+// copy the values of the live samples out of one column of X
+template <typename T>
+vector<T> DPTree::gather_column(const vector<T> &column, vector<int> &live_samples)
+{
+    vector<T> column_live(live_samples.size());
+    for (size_t i=0; i < live_samples.size(); i++) {
+        column_live[i] = column[(*rows)[live_samples[i]]];
+    }
+    return column_live;
+}
+
+
+// left (1) / right (0) for each live sample, when splitting on feature_index
+vector<int> DPTree::partition(vector<int> &live_samples, int feature_index, double split_value)
+{
+    const FeatureMatrix &X = *features;
+    int col = X.index[feature_index];
+    vector<int> lhs;
+    switch (X.kind[feature_index]) {
+        case FeatureMatrix::NUMERICAL: {
+            vector<feature_t> column_live = gather_column(X.numerical[col], live_samples);
+            samples_left_right_partition<feature_t, NumericalSplit>(lhs, column_live, split_value);
+            break;
+        } case FeatureMatrix::CATEGORICAL8: {
+            vector<uint8_t> column_live = gather_column(X.codes8[col], live_samples);
+            samples_left_right_partition<uint8_t, CategoricalSplit>(lhs, column_live, split_value);
+            break;
+        } case FeatureMatrix::CATEGORICAL16: {
+            vector<uint16_t> column_live = gather_column(X.codes16[col], live_samples);
+            samples_left_right_partition<uint16_t, CategoricalSplit>(lhs, column_live, split_value);
+            break;
+        } case FeatureMatrix::BINNED8: {
+            vector<uint8_t> column_live = gather_column(X.codes8[col], live_samples);
+            samples_left_right_partition<uint8_t, NumericalSplit>(lhs, column_live, split_value);
+            break;
+        } case FeatureMatrix::BINNED16: {
+            vector<uint16_t> column_live = gather_column(X.codes16[col], live_samples);
+            samples_left_right_partition<uint16_t, NumericalSplit>(lhs, column_live, split_value);
+            break;
+        }
+    }
+    return lhs;
+}
+
+
 TreeNode *DPTree::make_leaf_node(int current_depth, vector<int> &live_samples)
 {
     TreeNode *leaf = new TreeNode(true);
     leaf->depth = current_depth;
 
-    vector<double> gradients;
+    vector<double> leaf_gradients;
     for (auto index : live_samples) {
-        gradients.push_back(dataset->gradients[index]);
+        leaf_gradients.push_back((*gradients)[index]);
     }
     // compute prediction
-    leaf->prediction = (-1 * std::accumulate(gradients.begin(), gradients.end(), 0.0)
-                            / (gradients.size() + params->l2_lambda));
+    leaf->prediction = (-1 * std::accumulate(leaf_gradients.begin(), leaf_gradients.end(), 0.0)
+                            / (leaf_gradients.size() + params->l2_lambda));
     leaves.push_back(leaf);
     return(leaf);
 }
 
 
-vector<double> DPTree::predict(VVD &X)
+vector<double> DPTree::predict(const VVF &X)
 {
+    vector<bool> categorical(X.empty() ? 0 : X[0].size(), false);
+    for (auto col : params->cat_idx) {
+        categorical[col] = true;
+    }
+
     vector<double> predictions;
     // iterate over all samples
-    for (auto row : X) {
-        double pred = _predict(&row, root_node);
+    for (auto &row : X) {
+        double pred = _predict(&row, root_node, categorical);
         predictions.push_back(pred);
     }
 
@@ -145,30 +213,88 @@ vector<double> DPTree::predict(VVD &X)
 }
 
 
+// predict only the given rows of X
+vector<double> DPTree::predict(const FeatureMatrix &X, const vector<int> &rows)
+{
+    vector<double> predictions;
+    predictions.reserve(rows.size());
+    for (auto row : rows) {
+        TreeNode *node = root_node;
+        while (not node->is_leaf()) {
+            double row_val = X.value(row, node->split_attr);
+            bool left = X.is_categorical(node->split_attr) ? row_val == node->split_value
+                                                           : row_val < node->split_value;
+            node = left ? node->left : node->right;
+        }
+        predictions.push_back(node->prediction);
+    }
+    return predictions;
+}
+
+
 // recursively walk through decision tree
-double DPTree::_predict(vector<double> *row, TreeNode *node)
+double DPTree::_predict(const vector<feature_t> *row, TreeNode *node, const vector<bool> &categorical)
 {
     if(node->is_leaf()){
         return node->prediction;
     }
     double row_val = (*row)[node->split_attr];
 
-    if (std::find((params->cat_idx).begin(), (params->cat_idx).end(), node->split_attr) != (params->cat_idx).end()) {
+    if (categorical[node->split_attr]) {
         // categorical feature
         if (row_val == node->split_value){
-            return _predict(row, node->left);
+            return _predict(row, node->left, categorical);
         }
     } else { // numerical feature
         if (row_val < node->split_value){
-            return _predict(row, node->left);
+            return _predict(row, node->left, categorical);
+        }
+    }
+    return _predict(row, node->right, categorical);
+}
+
+
+// split candidates of one feature, each column type gets its own kernel
+template <typename Policy>
+void DPTree::scan_feature(int feature_index, vector<int> &live_samples, vector<double> &gradients_live,
+    double privacy_budget_for_node, vector<SplitCandidate> &candidates)
+{
+    const FeatureMatrix &X = *features;
+    int col = X.index[feature_index];
+    switch (X.kind[feature_index]) {
+        case FeatureMatrix::NUMERICAL: {
+            vector<feature_t> column_live = gather_column(X.numerical[col], live_samples);
+            find_splits<feature_t, NumericalSplit, Policy>(feature_index, column_live, gradients_live,
+                privacy_budget_for_node, candidates);
+            break;
+        } case FeatureMatrix::CATEGORICAL8: {
+            vector<uint8_t> column_live = gather_column(X.codes8[col], live_samples);
+            find_splits<uint8_t, CategoricalSplit, Policy>(feature_index, column_live, gradients_live,
+                privacy_budget_for_node, candidates);
+            break;
+        } case FeatureMatrix::CATEGORICAL16: {
+            vector<uint16_t> column_live = gather_column(X.codes16[col], live_samples);
+            find_splits<uint16_t, CategoricalSplit, Policy>(feature_index, column_live, gradients_live,
+                privacy_budget_for_node, candidates);
+            break;
+        } case FeatureMatrix::BINNED8: {
+            vector<uint8_t> column_live = gather_column(X.codes8[col], live_samples);
+            find_splits<uint8_t, NumericalSplit, Policy>(feature_index, column_live, gradients_live,
+                privacy_budget_for_node, candidates);
+            break;
+        } case FeatureMatrix::BINNED16: {
+            vector<uint16_t> column_live = gather_column(X.codes16[col], live_samples);
+            find_splits<uint16_t, NumericalSplit, Policy>(feature_index, column_live, gradients_live,
+                privacy_budget_for_node, candidates);
+            break;
         }
     }
-    return _predict(row, node->right);
 }
 
 
 // find best split of data using the exponential mechanism
-TreeNode *DPTree::find_best_split(VVD &X_live, vector<double> &gradients_live, int current_depth)
+template <typename Policy>
+TreeNode *DPTree::find_best_split(vector<int> &live_samples, vector<double> &gradients_live, int current_depth)
 {
     double privacy_budget_for_node;
     if (params->use_decay) {
@@ -181,38 +307,25 @@ TreeNode *DPTree::find_best_split(VVD &X_live, vector<double> &gradients_live, i
         privacy_budget_for_node = (tree_params->tree_privacy_budget) / (2 * params->max_depth );
     }
 
-    vector<SplitCandidate> probabilities;
-    int lhs_size;
-    
-    // iterate over features
-    for (int feature_index=0; feature_index < dataset->num_x_cols; feature_index++) {
-        bool categorical = std::find((params->cat_idx).begin(), (params->cat_idx).end(), feature_index) != (params->cat_idx).end();
-        std::set<double> unique;
-        
-        for (double feature_value : X_live[feature_index]) {
-            if (std::get<1>(unique.insert(feature_value)) == false){
-                // already had that value, will never happen in grid
-                continue;
-            }
-            // compute gain
-            double gain = compute_gain(X_live, gradients_live, feature_index, feature_value, lhs_size, categorical);
-            // feature cannot be chosen, skipping
-            if (gain == -1) {
-                continue;
-            }
-            // Gi = epsilon_nleaf * Gi / (2 * delta_G)
-            if(params->use_dp){
-                gain = (privacy_budget_for_node * gain) / (2 * tree_params->delta_g);
-            }
-            SplitCandidate candidate = SplitCandidate(feature_index, feature_value, gain);
-            candidate.lhs_size = lhs_size;
-            candidate.rhs_size = gradients_live.size() - lhs_size;
-            probabilities.push_back(candidate);
+    // the features are independent, with enough live rows they're scanned in
+    // parallel. Their candidates are then concatenated in feature order.
+    size_t num_features = features->num_cols();
+    vector<vector<SplitCandidate>> feature_candidates(num_features);
+    size_t num_chunks = Policy::verification ? 1 : std::min(num_features,
+        number_of_chunks(live_samples.size() * num_features, SPLIT_MIN_WORK));
+    parallel_for_chunks(num_features, num_chunks, [&](size_t, size_t begin, size_t end) {
+        for (size_t feature_index=begin; feature_index<end; feature_index++) {
+            scan_feature<Policy>(feature_index, live_samples, gradients_live, privacy_budget_for_node,
+                feature_candidates[feature_index]);
         }
+    });
+    vector<SplitCandidate> probabilities;
+    for (auto &candidates : feature_candidates) {
+        probabilities.insert(probabilities.end(), candidates.begin(), candidates.end());
     }
 
     // choose a split using the exponential mechanism
-    int index = exponential_mechanism(probabilities);
+    int index = exponential_mechanism<Policy>(probabilities);
 
     // construct the node
     TreeNode *node;
@@ -233,6 +346,37 @@ TreeNode *DPTree::find_best_split(VVD &X_live, vector<double> &gradients_live, i
 }
 
 
+// every value of the column is a split candidate, compute their gains
+template <typename T, typename Split, typename Policy>
+void DPTree::find_splits(int feature_index, vector<T> &column_live, vector<double> &gradients_live,
+    double privacy_budget_for_node, vector<SplitCandidate> &candidates)
+{
+    std::set<T> unique;
+    int lhs_size;
+
+    for (T feature_value : column_live) {
+        if (std::get<1>(unique.insert(feature_value)) == false){
+            // already had that value, will never happen in grid
+            continue;
+        }
+        // compute gain
+        double gain = compute_gain<T, Split, Policy>(column_live, gradients_live, feature_value, lhs_size);
+        // feature cannot be chosen, skipping
+        if (gain == -1) {
+            continue;
+        }
+        // Gi = epsilon_nleaf * Gi / (2 * delta_G)
+        if(Policy::use_dp){
+            gain = (privacy_budget_for_node * gain) / (2 * tree_params->delta_g);
+        }
+        SplitCandidate candidate = SplitCandidate(feature_index, feature_value, gain);
+        candidate.lhs_size = lhs_size;
+        candidate.rhs_size = gradients_live.size() - lhs_size;
+        candidates.push_back(candidate);
+    }
+}
+
+
 /*
     Computes the gain of a split
 
@@ -240,12 +384,13 @@ TreeNode *DPTree::find_best_split(VVD &X_live, vector<double> &gradients_live, i
     G(IL,IR) = ----------------     ----------------
                 |IL| + lambda        |IR| + lambda
 */
-double DPTree::compute_gain(VVD &samples, vector<double> &gradients_live,
-    int feature_index, double feature_value, int &lhs_size, bool categorical)
+template <typename T, typename Split, typename Policy>
+double DPTree::compute_gain(vector<T> &column_live, vector<double> &gradients_live,
+    T split_value, int &lhs_size)
 {
     // partition into lhs / rhs
     vector<int> lhs;
-    samples_left_right_partition(lhs, samples, feature_index, feature_value, categorical);
+    samples_left_right_partition<T, Split>(lhs, column_live, split_value);
 
     int _lhs_size = std::count(lhs.begin(), lhs.end(), 1);
     int _rhs_size = std::count(lhs.begin(), lhs.end(), 0);
@@ -267,7 +412,7 @@ double DPTree::compute_gain(VVD &samples, vector<double> &gradients_live,
 
     double total_gain = lhs_gain + rhs_gain;
 
-    if(VERIFICATION_MODE){
+    if(Policy::verification){
         // round to 10 decimals to avoid numeric issues in verification
         total_gain = std::floor(total_gain * 1e10) / 1e10;
     }
@@ -277,20 +422,12 @@ double DPTree::compute_gain(VVD &samples, vector<double> &gradients_live,
 
 
 // the result is am int array that will indicate left/right resp. 0/1
-void DPTree::samples_left_right_partition(vector<int> &lhs, VVD &samples,
-            int feature_index, double feature_value, bool categorical)
+template <typename T, typename Split>
+void DPTree::samples_left_right_partition(vector<int> &lhs, vector<T> &column_live, T split_value)
 {
-    // if the feature is categorical
-    if(categorical) {
-        for (auto sample : samples[feature_index]) {
-            size_t value = sample == feature_value;
-            lhs.push_back(value);
-        }
-    } else { // feature is numerical
-        for (auto sample : samples[feature_index]) {
-            size_t value = sample < feature_value;
-            lhs.push_back(value);
-        }
+    lhs.reserve(column_live.size());
+    for (T sample : column_live) {
+        lhs.push_back(Split::goes_left(sample, split_value));
     }
 }
 
@@ -299,6 +436,7 @@ void DPTree::samples_left_right_partition(vector<int> &lhs, VVD &samples,
 // be chosen for split). Then a cumulative distribution function is created from
 // these probabilities. Then we can sample from it using a RNG.
 // The function returns the index of the chosen split.
+template <typename Policy>
 int DPTree::exponential_mechanism(vector<SplitCandidate> &probs)
 {
     // if no split has a positive gain, return. Node will become a leaf
@@ -309,21 +447,23 @@ int DPTree::exponential_mechanism(vector<SplitCandidate> &probs)
     }
 
     // calculate the probabilities from the gains
-    vector<double> gains, probabilities, partials(probs.size());
+    vector<double> gains, probabilities(probs.size()), partials(probs.size());
     for (auto p : probs) {
         gains.push_back(p.gain);
     }
-    double lse = log_sum_exp(gains);
-    for (auto prob : probs) {
-        if (prob.gain <= 0) {
-            probabilities.push_back(0);   
-        } else {
-            probabilities.push_back( exp(prob.gain - lse) );
+    double lse = log_sum_exp(gains, Policy::verification);
+    for (size_t i=0; i<probs.size(); i++) {
+        probabilities[i] = probs[i].gain - lse;
+    }
+    vexp(probabilities.data(), probabilities.data(), probabilities.size(), Policy::verification);
+    for (size_t i=0; i<probs.size(); i++) {
+        if (probs[i].gain <= 0) {
+            probabilities[i] = 0;
         }
     }
 
     // non-dp: deterministically choose the best split
-    if (!params->use_dp or VERIFICATION_MODE) {
+    if (!Policy::use_dp or Policy::verification) {
         auto max_elem = std::max_element(probabilities.begin(), probabilities.end());
         // return index of the max_elem
         return std::distance(probabilities.begin(), max_elem);
@@ -333,7 +473,7 @@ int DPTree::exponential_mechanism(vector<SplitCandidate> &probs)
     // all values will be in [0,1]
     std::partial_sum(probabilities.begin(), probabilities.end(), partials.begin());
 
-    double rand01 = ((double) std::rand() / (RAND_MAX));
+    double rand01 = ((double) random->next() / (RAND_MAX));
 
     // try to find a candidate at least 10 times before giving up and making the node a leaf node
     for (int tries=0; tries<10; tries++) {
@@ -342,34 +482,36 @@ int DPTree::exponential_mechanism(vector<SplitCandidate> &probs)
                 return index;
             }
         }
-        rand01 = ((double) rand() / (RAND_MAX));
+        rand01 = ((double) random->next() / (RAND_MAX));
     }
     return -1;
 }
 
 
+template <typename Policy>
 void DPTree::add_laplacian_noise(double laplace_scale)
 {
-    if(VERIFICATION_MODE){
+    if(Policy::verification){
         double sum = 0;
         for (auto leaf : leaves) {
             sum += leaf->prediction;
         }
         sum = sum < 0 && sum >= -1e-10 ? 0 : sum;
         LOG_DEBUG("NUMLEAVES {1} LEAFSUM {2:.8f}", leaves.size(), sum);
-        VERIFICATION_LOG("LEAFVALUESSUM {0:.10f}", sum);
+        VERIFICATION_LOG(context, "LEAFVALUESSUM {0:.10f}", sum);
         return;
     }
 
     LOG_DEBUG("Adding Laplace noise to leaves (Scale {1:.2f})", laplace_scale);
 
-    Laplace lap(laplace_scale, rand());
+    Laplace lap(laplace_scale, random->next());
+    std::vector<double> noise(leaves.size());
+    lap.fill(noise);
 
     // add noise from laplace distribution to leaves
-    for (auto &leaf : leaves) {
-        double noise = lap.return_a_random_variable(laplace_scale);
-        leaf->prediction += noise;
-        LOG_DEBUG("({1:.3f} -> {2:.8f})", leaf->prediction, leaf->prediction+noise);
+    for (size_t i=0; i<leaves.size(); i++) {
+        LOG_DEBUG("({1:.3f} -> {2:.8f})", leaves[i]->prediction, leaves[i]->prediction+noise[i]);
+        leaves[i]->prediction += noise[i];
     }
 }
 
@@ -429,6 +571,63 @@ void DPTree::recursive_print_tree(TreeNode* node) {
 }
 
 
+// preorder, returns the index of node in nodes
+static int32_t flatten_node(TreeNode *node, std::vector<FlatNode> &nodes)
+{
+    int32_t index = nodes.size();
+    nodes.push_back({node->split_attr, node->depth, -1, -1, node->split_value, node->prediction});
+    if (not node->is_leaf()) {
+        int32_t left = flatten_node(node->left, nodes);
+        int32_t right = flatten_node(node->right, nodes);
+        nodes[index].left = left;
+        nodes[index].right = right;
+    }
+    return index;
+}
+
+// the tree as an array of nodes (see FlatNode)
+vector<FlatNode> DPTree::flatten()
+{
+    vector<FlatNode> nodes;
+    flatten_node(root_node, nodes);
+    return nodes;
+}
+
+
+// rebuild the tree from an array of nodes (e.g. a loaded one). Only the layout
+// flatten writes is accepted, anything else (e.g. a node with two parents) throws.
+void DPTree::from_flat(const FlatNode *nodes, size_t num_nodes)
+{
+    if (not is_preorder_tree(nodes, num_nodes)) {
+        throw std::runtime_error("invalid tree: nodes are not a tree in preorder");
+    }
+    vector<TreeNode *> built;
+    try {
+        for (size_t i=0; i<num_nodes; i++) {
+            const FlatNode &flat = nodes[i];
+            built.push_back(new TreeNode(flat.left == -1));
+            built.back()->split_attr = flat.split_attr;
+            built.back()->depth = flat.depth;
+            built.back()->split_value = flat.split_value;
+            built.back()->prediction = flat.prediction;
+        }
+    } catch (...) {
+        for (auto node : built) {
+            delete node;
+        }
+        throw;
+    }
+    for (size_t i=0; i<num_nodes; i++) {
+        if (not built[i]->is_leaf()) {
+            built[i]->left = built[nodes[i].left];
+            built[i]->right = built[nodes[i].right];
+        }
+    }
+    root_node = built[0];
+    leaves.clear();
+}
+
+
 // free allocated ressources
 void DPTree::delete_tree(TreeNode *node)
 {
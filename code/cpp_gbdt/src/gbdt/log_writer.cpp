@@ -0,0 +1,77 @@
+#include "log_writer.h"
+
+using namespace std;
+
+
+/** Constructors */
+
+AsyncLogWriter::AsyncLogWriter(std::ostream &out, size_t buffer_size) : out(out), buffer_size(buffer_size)
+{
+    buffer.reserve(buffer_size);
+    thread = std::thread(&AsyncLogWriter::run, this);
+}
+
+AsyncLogWriter::~AsyncLogWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    thread.join();
+    out.flush();
+}
+
+
+/** Methods */
+
+void AsyncLogWriter::write(const std::string &line)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    // back pressure, don't let the buffer grow without bounds
+    written.wait(lock, [this]() { return buffer.size() < 4 * buffer_size; });
+    buffer += line;
+    buffer += '\n';
+    if ((buffer.size() >= buffer_size or flushes > 0) and not writing) {
+        wake.notify_one();
+    }
+}
+
+void AsyncLogWriter::flush()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    flushes++;
+    wake.notify_one();
+    written.wait(lock, [this]() { return buffer.empty() and not writing; });
+    flushes--;
+    out.flush();
+}
+
+void AsyncLogWriter::run()
+{
+    std::string chunk;
+    chunk.reserve(buffer_size);
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [this]() { return buffer.size() >= buffer_size or flushes > 0 or stopping; });
+        if (buffer.empty()) {
+            if (stopping) {
+                return;
+            }
+            // nothing left to flush
+            written.notify_all();
+            if (flushes > 0) {
+                wake.wait(lock, [this]() { return flushes == 0 or stopping or not buffer.empty(); });
+            }
+            continue;
+        }
+        chunk.swap(buffer);
+        writing = true;
+        lock.unlock();
+        out.write(chunk.data(), chunk.size());
+        chunk.clear();
+        lock.lock();
+        writing = false;
+        written.notify_all();
+    }
+}
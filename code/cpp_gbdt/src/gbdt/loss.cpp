@@ -1,37 +1,64 @@
 #include "loss.h"
+#include "vector_math.h"
 #include <set>
 #include <map>
 #include <cmath>
 #include <numeric>
 #include <algorithm>
 #include <iostream>
+#include <limits>
 
-extern bool VERIFICATION_MODE;
+
+// limit the numbers of decimals to avoid numeric inconsistencies
+static void round_for_verification(std::vector<double> &gradients)
+{
+    std::transform(gradients.begin(), gradients.end(),
+            gradients.begin(), [](double c){ return std::floor(c * 1e15) / 1e15; });
+}
 
 /* ---------- Regression ---------- */
 
-double Regression::compute_init_score(std::vector<double> &y)
+std::vector<double> Regression::compute_init_score(std::vector<double> &y)
 {
     // mean
     double sum = std::accumulate(y.begin(), y.end(), 0.0);
-    return sum / y.size();
+    return {sum / y.size()};
 }
 
-std::vector<double> Regression::compute_gradients(std::vector<double> &y, std::vector<double> &y_pred)
+std::vector<double> Regression::compute_gradients(std::vector<double> &y, std::vector<double> &y_pred,
+    bool verification)
     {
         std::vector<double> gradients(y.size());
         for (size_t i=0; i<y.size(); i++) {
             gradients[i] = y_pred[i] - y[i];
         }
         
-        if(VERIFICATION_MODE){
-            // limit the numbers of decimals to avoid numeric inconsistencies
-            std::transform(gradients.begin(), gradients.end(),
-                    gradients.begin(), [](double c){ return std::floor(c * 1e15) / 1e15; });
+        if(verification){
+            round_for_verification(gradients);
         }
 
         return gradients;
     }
+
+// one pass over plain arrays, no branches -> vectorizes with "make fast"
+void Regression::update_gradients(const std::vector<double> &y, std::vector<double> &tree_sums,
+    const std::vector<double> &tree_pred, double learning_rate, const std::vector<double> &init_score,
+    std::vector<double> &gradients, bool verification)
+{
+    size_t n = y.size();
+    gradients.resize(n);
+    const double *y_ = y.data(), *pred_ = tree_pred.data();
+    double *sums_ = tree_sums.data(), *grad_ = gradients.data();
+    double score = init_score[0];
+    for (size_t i=0; i<n; i++) {
+        sums_[i] += pred_[i];
+        grad_[i] = (sums_[i] * learning_rate + score) - y_[i];
+    }
+
+    if(verification){
+        round_for_verification(gradients);
+    }
+}
     
 double Regression::compute_score(std::vector<double> &y, std::vector<double> y_pred)
 {
@@ -50,7 +77,7 @@ double Regression::compute_score(std::vector<double> &y, std::vector<double> y_p
 
 // Uses Binomial Deviancec
 
-double BinaryClassification::compute_init_score(std::vector<double> &y)
+std::vector<double> BinaryClassification::compute_init_score(std::vector<double> &y)
 {
     // count how many samples are in each of the 2 classes
     std::map<double,double> occurrences;
@@ -69,31 +96,53 @@ double BinaryClassification::compute_init_score(std::vector<double> &y)
     double smaller_value = *occs.rbegin();
     // "log(x / (1-x)) is the inverse of the sigmoid (expit) function"
     double prediction = std::log(smaller_value / (1- smaller_value));
-    return prediction;
+    return {prediction};
 }
 
-std::vector<double> BinaryClassification::compute_gradients(std::vector<double> &y, std::vector<double> &y_pred)
+std::vector<double> BinaryClassification::compute_gradients(std::vector<double> &y, std::vector<double> &y_pred,
+    bool verification)
     {
         // positive gradient: expit(y_pred) - y
         // expit(x): (logistic sigmoid function) = 1/(1+exp(-x))
         std::vector<double> gradients(y.size());
+        vsigmoid(y_pred.data(), gradients.data(), y.size(), verification);
         for (size_t i=0; i<y.size(); i++) {
-            gradients[i] = 1 / (1 + std::exp(-y_pred[i])) - y[i];
+            gradients[i] -= y[i];
         }
 
-        if(VERIFICATION_MODE){
-            // limit the numbers of decimals to avoid numeric inconsistencies
-            std::transform(gradients.begin(), gradients.end(),
-                    gradients.begin(), [](double c){ return std::floor(c * 1e15) / 1e15; });
+        if(verification){
+            round_for_verification(gradients);
         }
         return gradients;
     }
 
+void BinaryClassification::update_gradients(const std::vector<double> &y, std::vector<double> &tree_sums,
+    const std::vector<double> &tree_pred, double learning_rate, const std::vector<double> &init_score,
+    std::vector<double> &gradients, bool verification)
+{
+    size_t n = y.size();
+    gradients.resize(n);
+    const double *y_ = y.data(), *pred_ = tree_pred.data();
+    double *sums_ = tree_sums.data(), *grad_ = gradients.data();
+    double score = init_score[0];
+    for (size_t i=0; i<n; i++) {
+        sums_[i] += pred_[i];
+        grad_[i] = sums_[i] * learning_rate + score;
+    }
+    vsigmoid(grad_, grad_, n, verification);
+    for (size_t i=0; i<n; i++) {
+        grad_[i] -= y_[i];
+    }
+
+    if(verification){
+        round_for_verification(gradients);
+    }
+}
+
 double BinaryClassification::compute_score(std::vector<double> &y, std::vector<double> y_pred)
 {
     // classification task -> transform continuous predictions back to labels
-    std::transform(y_pred.begin(), y_pred.end(), // expit
-        y_pred.begin(), [](double &c){ return 1 / (1 + std::exp(-c)); });
+    vsigmoid(y_pred.data(), y_pred.data(), y_pred.size());   // expit
     for(auto &elem : y_pred){
         elem = (elem < 1.-elem) ? 0.0 : 1.0;
     }
@@ -105,4 +154,106 @@ double BinaryClassification::compute_score(std::vector<double> &y, std::vector<d
     }
     double true_preds = std::count(correct_preds.begin(), correct_preds.end(), true);
     return (1 - true_preds / y.size()) * 100;
-}
\ No newline at end of file
+}
+
+/* ---------- Multi-Class Classification ---------- */
+
+// Uses Multinomial Deviance
+
+std::vector<double> MultiClassification::compute_init_score(std::vector<double> &y)
+{
+    // log of the fraction of samples in each class (clipped like sklearn does,
+    // classes that don't occur would otherwise start at -inf)
+    std::vector<double> priors(num_classes, 0);
+    for (auto elem : y) {
+        priors[(int) elem] += 1;
+    }
+    for (auto &prior : priors) {
+        prior = std::max(prior / y.size(), (double) std::numeric_limits<float>::epsilon());
+    }
+    // scalar log, the same in every build (gcc would vectorize a plain loop here)
+    vlog(priors.data(), priors.data(), num_classes, true);
+    return priors;
+}
+
+// raw predictions (K blocks of n) -> positive gradients softmax(raw)_k - [y == k], in place.
+// Every loop runs over one block, so they vectorize and the exps are done in one vexp.
+static void softmax_gradients(const std::vector<double> &y, std::vector<double> &raw, int num_classes, bool exact)
+{
+    size_t n = y.size();
+    double *raw_ = raw.data();
+    std::vector<double> row_max(raw_, raw_ + n), row_sum(n, 0);
+    for (int k=1; k<num_classes; k++) {
+        for (size_t i=0; i<n; i++) {
+            row_max[i] = std::max(row_max[i], raw_[k*n + i]);
+        }
+    }
+    for (int k=0; k<num_classes; k++) {
+        for (size_t i=0; i<n; i++) {
+            raw_[k*n + i] -= row_max[i];
+        }
+    }
+    vexp(raw_, raw_, n * num_classes, exact);
+    for (int k=0; k<num_classes; k++) {
+        for (size_t i=0; i<n; i++) {
+            row_sum[i] += raw_[k*n + i];
+        }
+    }
+    for (int k=0; k<num_classes; k++) {
+        for (size_t i=0; i<n; i++) {
+            raw_[k*n + i] = raw_[k*n + i] / row_sum[i] - (y[i] == k);
+        }
+    }
+}
+
+std::vector<double> MultiClassification::compute_gradients(std::vector<double> &y, std::vector<double> &y_pred,
+    bool verification)
+{
+    std::vector<double> gradients = y_pred;
+    softmax_gradients(y, gradients, num_classes, verification);
+
+    if(verification){
+        round_for_verification(gradients);
+    }
+    return gradients;
+}
+
+void MultiClassification::update_gradients(const std::vector<double> &y, std::vector<double> &tree_sums,
+    const std::vector<double> &tree_pred, double learning_rate, const std::vector<double> &init_score,
+    std::vector<double> &gradients, bool verification)
+{
+    size_t n = y.size();
+    gradients.resize(n * num_classes);
+    const double *pred_ = tree_pred.data();
+    double *sums_ = tree_sums.data(), *grad_ = gradients.data();
+    for (int k=0; k<num_classes; k++) {
+        double score = init_score[k];
+        for (size_t i=k*n; i<(k+1)*n; i++) {
+            sums_[i] += pred_[i];
+            grad_[i] = sums_[i] * learning_rate + score;
+        }
+    }
+    softmax_gradients(y, gradients, num_classes, verification);
+
+    if(verification){
+        round_for_verification(gradients);
+    }
+}
+
+double MultiClassification::compute_score(std::vector<double> &y, std::vector<double> y_pred)
+{
+    // predicted label: class with the highest raw prediction
+    size_t n = y.size();
+    double wrong_preds = 0;
+    for (size_t i=0; i<n; i++) {
+        int label = 0;
+        for (int k=1; k<num_classes; k++) {
+            if (y_pred[k*n + i] > y_pred[label*n + i]) {
+                label = k;
+            }
+        }
+        wrong_preds += (label != y[i]);
+    }
+    // misclassification rate
+    return wrong_preds / n * 100;
+}
@@ -0,0 +1,153 @@
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "model_file.h"
+
+using namespace std;
+
+
+// does [offset, offset + count * elem_size) lie within the file, properly aligned?
+static bool in_file(uint64_t offset, uint64_t count, size_t elem_size, size_t alignment, size_t size)
+{
+    return offset % alignment == 0 and offset <= size and count <= (size - offset) / elem_size;
+}
+
+const ModelFileHeader *check_model_file(const char *data, size_t size)
+{
+    if (size < sizeof(ModelFileHeader) or not std::equal(MODEL_MAGIC, MODEL_MAGIC + sizeof(MODEL_MAGIC), data)) {
+        throw std::runtime_error("not a model file");
+    }
+    if (reinterpret_cast<uintptr_t>(data) % alignof(ModelFileHeader) != 0) {
+        throw std::runtime_error("model file data is misaligned");
+    }
+    const ModelFileHeader *header = reinterpret_cast<const ModelFileHeader *>(data);
+    if (header->version != MODEL_VERSION) {
+        throw std::runtime_error("model file version " + std::to_string(header->version)
+            + " is not supported (expected " + std::to_string(MODEL_VERSION) + ")");
+    }
+    if (header->file_size != size) {
+        throw std::runtime_error("model file is truncated");
+    }
+    uint64_t K = header->num_outputs, num_trees = header->num_trees;
+    if (K == 0 or num_trees % K != 0) {
+        throw std::runtime_error("model file has an incomplete boosting round");
+    }
+    if (not in_file(header->params_offset, header->params_size, 1, 1, size)
+            or not in_file(header->init_score_offset, K, sizeof(double), alignof(double), size)
+            or not in_file(header->categorical_offset, header->num_features, 1, 1, size)
+            or num_trees == UINT64_MAX
+            or not in_file(header->tree_offsets_offset, num_trees + 1, sizeof(uint64_t), alignof(uint64_t), size)) {
+        throw std::runtime_error("model file has a section outside of the file");
+    }
+
+    // each tree is a non-empty range of nodes in the preorder layout of
+    // DPTree::flatten, so any walk down a tree ends at one of its leaves
+    const uint64_t *tree_offsets = reinterpret_cast<const uint64_t *>(data + header->tree_offsets_offset);
+    uint64_t num_nodes = tree_offsets[num_trees];
+    if (tree_offsets[0] != 0 or not in_file(header->nodes_offset, num_nodes, sizeof(FlatNode), alignof(FlatNode), size)) {
+        throw std::runtime_error("model file has a section outside of the file");
+    }
+    const FlatNode *nodes = reinterpret_cast<const FlatNode *>(data + header->nodes_offset);
+    for (uint64_t t=0; t<num_trees; t++) {
+        uint64_t begin = tree_offsets[t], end = tree_offsets[t+1];
+        if (end <= begin or end > num_nodes or not is_preorder_tree(nodes + begin, end - begin)) {
+            throw std::runtime_error("model file has an invalid tree");
+        }
+        for (uint64_t i=begin; i<end; i++) {
+            const FlatNode &node = nodes[i];
+            if (node.left != -1 and (node.split_attr < 0 or (uint32_t) node.split_attr >= header->num_features)) {
+                throw std::runtime_error("model file has an invalid tree");
+            }
+        }
+    }
+    return header;
+}
+
+
+/** Constructors */
+
+MappedModel::MappedModel(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat file_stat;
+    if (fd == -1 or fstat(fd, &file_stat) == -1 or file_stat.st_size == 0) {
+        if (fd != -1) {
+            close(fd);
+        }
+        throw std::runtime_error("can't read model file " + path);
+    }
+    size = file_stat.st_size;
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        throw std::runtime_error("can't map model file " + path);
+    }
+    data = static_cast<const char *>(mapping);
+
+    try {
+        header = check_model_file(data, size);
+    } catch (const std::runtime_error &error) {
+        munmap(mapping, size);
+        throw std::runtime_error(path + ": " + error.what());
+    }
+    init_score = reinterpret_cast<const double *>(data + header->init_score_offset);
+    categorical = reinterpret_cast<const uint8_t *>(data + header->categorical_offset);
+    tree_offsets = reinterpret_cast<const uint64_t *>(data + header->tree_offsets_offset);
+    nodes = reinterpret_cast<const FlatNode *>(data + header->nodes_offset);
+}
+
+MappedModel::~MappedModel()
+{
+    munmap(const_cast<char *>(data), size);
+}
+
+
+/** Methods */
+
+double MappedModel::predict_tree(size_t tree, const feature_t *row) const
+{
+    const FlatNode *tree_nodes = nodes + tree_offsets[tree];
+    const FlatNode *node = tree_nodes;
+    while (node->left != -1) {
+        double row_val = row[node->split_attr];
+        bool left = categorical[node->split_attr] ? row_val == node->split_value
+                                                  : row_val < node->split_value;
+        node = tree_nodes + (left ? node->left : node->right);
+    }
+    return node->prediction;
+}
+
+
+// same summation order as DPEnsemble::predict, so the results are identical
+void MappedModel::predict(const feature_t *row, double *out) const
+{
+    size_t K = header->num_outputs;
+    std::fill(out, out + K, 0.0);
+    for (size_t t=0; t<header->num_trees; t++) {
+        out[t % K] += predict_tree(t, row);
+    }
+    for (size_t k=0; k<K; k++) {
+        out[k] = out[k] * header->learning_rate + init_score[k];
+    }
+}
+
+
+// K blocks of X.size() values (see Task)
+vector<double> MappedModel::predict(const VVF &X) const
+{
+    size_t K = header->num_outputs, n = X.size();
+    vector<double> predictions(n * K), row_out(K);
+    for (size_t i=0; i<n; i++) {
+        if (X[i].size() < header->num_features) {
+            throw std::runtime_error("row has fewer features than the model uses");
+        }
+        predict(X[i].data(), row_out.data());
+        for (size_t k=0; k<K; k++) {
+            predictions[k * n + i] = row_out[k];
+        }
+    }
+    return predictions;
+}
@@ -0,0 +1,62 @@
+#include <cstring>
+#include "run_context.h"
+
+
+/** Random */
+
+// a state of 128 bytes selects the generator std::rand uses (TYPE_3)
+Random::Random(unsigned seed)
+{
+    memset(&data, 0, sizeof(data));
+    initstate_r(seed, state, sizeof(state), &data);
+}
+
+void Random::seed(unsigned seed)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    srandom_r(seed, &data);
+}
+
+int Random::next()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    int32_t value;
+    random_r(&data, &value);
+    return value;
+}
+
+// rejection sampling: draws from the incomplete last block of n values (which
+// next() % n would map to the low values more often) are drawn again
+size_t Random::uniform(size_t n)
+{
+    const size_t range = (size_t) RAND_MAX + 1;
+    const size_t limit = range - range % n;
+    size_t value;
+    do {
+        value = next();
+    } while (value >= limit);
+    return value % n;
+}
+
+
+/** RunContext */
+
+void RunContext::log_verification(const std::string &line)
+{
+    if (verification_log == nullptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(log_mutex);
+    if (not log_writer) {
+        log_writer.reset(new AsyncLogWriter(*verification_log));
+    }
+    log_writer->write(line);
+}
+
+void RunContext::flush_verification_log()
+{
+    std::lock_guard<std::mutex> lock(log_mutex);
+    if (log_writer) {
+        log_writer->flush();
+    }
+}
@@ -0,0 +1,125 @@
+#include <algorithm>
+#include <cmath>
+#include "statistics.h"
+
+
+/** RunningStats */
+
+void RunningStats::add(double x)
+{
+    n++;
+    double delta = x - mu;
+    mu += delta / n;
+    m2 += delta * (x - mu);
+}
+
+double RunningStats::stdev() const
+{
+    return n == 0 ? 0 : std::sqrt(m2 / n);
+}
+
+double RunningStats::sample_stdev() const
+{
+    return n < 2 ? 0 : std::sqrt(m2 / (n - 1));
+}
+
+// two-sided 97.5% quantiles of Student's t for 1..30 degrees of freedom,
+// beyond that the normal one is close enough
+static const double T_975[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+
+double RunningStats::ci95_half_width() const
+{
+    if (n < 2) {
+        return 0;
+    }
+    size_t df = n - 1;
+    double t = df <= 30 ? T_975[df - 1] : 1.960;
+    return t * sample_stdev() / std::sqrt((double) n);
+}
+
+
+/** P2Quantile */
+
+P2Quantile::P2Quantile(double p) : p(p)
+{
+    double init_desired[5] = {0, 2 * p, 4 * p, 2 + 2 * p, 4};
+    double init_increments[5] = {0, p / 2, p, (1 + p) / 2, 1};
+    for (int i=0; i<5; i++) {
+        positions[i] = i;
+        desired[i] = init_desired[i];
+        increments[i] = init_increments[i];
+    }
+}
+
+void P2Quantile::add(double x)
+{
+    // the first five values are the markers
+    if (count < 5) {
+        heights[count++] = x;
+        if (count == 5) {
+            std::sort(heights, heights + 5);
+        }
+        return;
+    }
+    count++;
+
+    // cell of x, the extreme markers follow the min / max
+    int k;
+    if (x < heights[0]) {
+        heights[0] = x;
+        k = 0;
+    } else if (x >= heights[4]) {
+        heights[4] = x;
+        k = 3;
+    } else {
+        k = std::upper_bound(heights + 1, heights + 4, x) - heights - 1;
+    }
+    for (int i=k+1; i<5; i++) {
+        positions[i]++;
+    }
+    for (int i=0; i<5; i++) {
+        desired[i] += increments[i];
+    }
+
+    // move the middle markers towards their desired positions
+    for (int i=1; i<4; i++) {
+        double d = desired[i] - positions[i];
+        if ((d >= 1 and positions[i+1] - positions[i] > 1) or (d <= -1 and positions[i-1] - positions[i] < -1)) {
+            int step = d > 0 ? 1 : -1;
+            double height = parabolic(i, step);
+            if (not (heights[i-1] < height and height < heights[i+1])) {
+                height = linear(i, step);
+            }
+            heights[i] = height;
+            positions[i] += step;
+        }
+    }
+}
+
+double P2Quantile::value() const
+{
+    if (count == 0) {
+        return NAN;
+    }
+    if (count <= 5) {
+        double sorted[5];
+        std::copy(heights, heights + count, sorted);
+        std::sort(sorted, sorted + count);
+        return sorted[std::min(count - 1, (size_t) std::lround(p * (count - 1)))];
+    }
+    return heights[2];
+}
+
+double P2Quantile::parabolic(int i, double d) const
+{
+    return heights[i] + d / (positions[i+1] - positions[i-1]) *
+        ((positions[i] - positions[i-1] + d) * (heights[i+1] - heights[i]) / (positions[i+1] - positions[i]) +
+         (positions[i+1] - positions[i] - d) * (heights[i] - heights[i-1]) / (positions[i] - positions[i-1]));
+}
+
+double P2Quantile::linear(int i, int d) const
+{
+    return heights[i] + d * (heights[i+d] - heights[i]) / (positions[i+d] - positions[i]);
+}
@@ -0,0 +1,200 @@
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include "thread_pool.h"
+
+using namespace std;
+
+static size_t configured_workers = 0;
+static std::atomic<bool> pool_started(false);
+
+// the pool (and queue) the calling thread works for, if it's a worker
+static thread_local const ThreadPool *current_pool = nullptr;
+static thread_local size_t current_queue = 0;
+
+
+/** Constructors */
+
+ThreadPool &ThreadPool::instance()
+{
+    static ThreadPool pool(configured_workers);
+    return pool;
+}
+
+void ThreadPool::set_num_workers(size_t num_workers)
+{
+    configured_workers = num_workers;
+}
+
+bool ThreadPool::started()
+{
+    return pool_started;
+}
+
+ThreadPool::ThreadPool(size_t num_workers) : pending(0)
+{
+    pool_started = true;
+    if (num_workers == 0) {
+        num_workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (size_t i=0; i<=num_workers; i++) {
+        queues.push_back(std::unique_ptr<TaskQueue>(new TaskQueue()));
+    }
+    for (size_t i=0; i<num_workers; i++) {
+        threads.push_back(std::thread(&ThreadPool::work, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+
+/** Methods */
+
+// workers queue their own tasks locally, everyone else uses the shared queue
+void ThreadPool::submit(std::function<void()> task, const TaskGroup *group)
+{
+    TaskQueue &queue = current_pool == this ? *queues[current_queue] : *queues.back();
+    {
+        // counted first, so pending never drops below the number of queued tasks
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        pending++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back({std::move(task), group});
+    }
+    wake.notify_one();
+}
+
+
+// own queue (newest first), then the shared queue, then steal the oldest task of another
+// worker. With a group only its tasks are taken (found by scanning the queues).
+bool ThreadPool::pop(std::function<void()> &task, const TaskGroup *group)
+{
+    size_t num_queues = queues.size();
+    bool is_worker = current_pool == this;
+    size_t own = is_worker ? current_queue : num_queues - 1;
+    for (size_t i=0; i<num_queues; i++) {
+        size_t index = (own + i) % num_queues;
+        TaskQueue &queue = *queues[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            continue;
+        }
+        auto match = [group](const Task &queued) { return group == nullptr or queued.group == group; };
+        std::deque<Task>::iterator found;
+        if (is_worker and i == 0) {
+            auto newest = std::find_if(queue.tasks.rbegin(), queue.tasks.rend(), match);
+            found = newest == queue.tasks.rend() ? queue.tasks.end() : std::prev(newest.base());
+        } else {
+            found = std::find_if(queue.tasks.begin(), queue.tasks.end(), match);
+        }
+        if (found == queue.tasks.end()) {
+            continue;
+        }
+        task = std::move(found->function);
+        queue.tasks.erase(found);
+        pending--;
+        return true;
+    }
+    return false;
+}
+
+
+bool ThreadPool::run_one(const TaskGroup *group)
+{
+    std::function<void()> task;
+    if (not pop(task, group)) {
+        return false;
+    }
+    task();
+    return true;
+}
+
+
+void ThreadPool::work(size_t index)
+{
+    current_pool = this;
+    current_queue = index;
+    while (true) {
+        if (run_one()) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        wake.wait(lock, [this]() { return stopping or pending > 0; });
+        if (stopping and pending == 0) {
+            return;
+        }
+    }
+}
+
+
+/** TaskGroup */
+
+TaskGroup::~TaskGroup()
+{
+    try {
+        wait();
+    } catch (...) {
+        // the owner didn't wait, nobody to report to
+    }
+}
+
+void TaskGroup::run(std::function<void()> task)
+{
+    remaining++;
+    pool.submit([this, task]() {
+        try {
+            task();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (not error) {
+                error = std::current_exception();
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--remaining == 0) {
+            finished.notify_all();
+        }
+    }, this);
+}
+
+// runs this group's pending tasks until all of them are done. Tasks of other
+// groups are left to the workers: running them here would nest them on this
+// stack (without bound) and add their run time to this wait. A task of this
+// group only waits for its own (nested) groups, so this can't deadlock.
+void TaskGroup::wait()
+{
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (remaining == 0) {
+                break;
+            }
+        }
+        if (pool.run_one(this)) {
+            continue;
+        }
+        // nothing to help with, the remaining tasks are running elsewhere
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait_for(lock, std::chrono::milliseconds(1), [this]() { return remaining == 0; });
+    }
+    std::exception_ptr first_error;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::swap(first_error, error);
+    }
+    if (first_error) {
+        std::rethrow_exception(first_error);
+    }
+}
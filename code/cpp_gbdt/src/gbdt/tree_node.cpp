@@ -1,3 +1,4 @@
+#include <vector>
 #include "tree_node.h"
 
 
@@ -17,4 +18,39 @@ bool TreeNode::is_leaf() {
 }
 
 
-
+// one pass, without recursion (the nodes may come from an untrusted file).
+// parents holds the inner nodes whose right child hasn't come yet.
+bool is_preorder_tree(const FlatNode *nodes, size_t num_nodes)
+{
+    if (num_nodes == 0 or num_nodes > INT32_MAX) {
+        return false;
+    }
+    std::vector<int32_t> parents;
+    for (int32_t i=0; (size_t) i<num_nodes; i++) {
+        const FlatNode &node = nodes[i];
+        if (i > 0) {
+            const FlatNode &previous = nodes[i-1];
+            if (previous.left != -1) {
+                // i is the left child of the previous node
+                if (previous.left != i) {
+                    return false;
+                }
+            } else {
+                // the previous subtree is complete, i is the right child of its parent
+                if (parents.empty() or nodes[parents.back()].right != i) {
+                    return false;
+                }
+                parents.pop_back();
+            }
+        }
+        if (node.left == -1) {
+            if (node.right != -1) {
+                return false;
+            }
+        } else {
+            parents.push_back(i);
+        }
+    }
+    // the last node is a leaf that completes the tree
+    return nodes[num_nodes-1].left == -1 and parents.empty();
+}
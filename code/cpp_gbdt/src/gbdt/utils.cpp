@@ -2,15 +2,12 @@
 #include <cmath>
 #include <numeric>
 #include <random>
-#include <mutex>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/stat.h>
 #include "utils.h"
-
-
-/** Global Variables */
-
-bool VERIFICATION_MODE;
-size_t cv_fold_index;
-std::once_flag flag1;
+#include "vector_math.h"
 
 
 /** Methods */
@@ -37,14 +34,18 @@ double clamp(double n, double lower, double upper)
 }
 
 
-double log_sum_exp(std::vector<double> vec)
+double log_sum_exp(std::vector<double> vec, bool exact)
 {
     size_t count = vec.size();
     if (count > 0) {
         double maxVal = *std::max_element(vec.begin(), vec.end());
+        for (size_t i = 0; i < count; i++) {
+            vec[i] -= maxVal;
+        }
+        vexp(vec.data(), vec.data(), count, exact);
         double sum = 0;
         for (size_t i = 0; i < count; i++) {
-            sum += exp(vec[i] - maxVal);
+            sum += vec[i];
         }
         return log(sum) + maxVal;
     } else {
@@ -73,3 +74,28 @@ std::string get_time_string()
     strftime(buffer,80,"%m.%d_%H:%M:%S",now);
     return std::string(buffer);
 }
+
+
+// opens path for writing, missing directories on the way are created. Throws
+// if that fails, so that results aren't silently lost.
+void open_output_file(std::ofstream &out, const std::string &path)
+{
+    for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+        std::string dir = path.substr(0, slash);
+        if (mkdir(dir.c_str(), 0775) != 0 and errno != EEXIST) {
+            throw std::runtime_error("can't create directory " + dir + ": " + strerror(errno));
+        }
+    }
+    out.open(path);
+    if (not out.is_open()) {
+        throw std::runtime_error("can't open output file " + path + ": " + strerror(errno));
+    }
+}
+
+
+// as many chunks as there are pool workers, but none smaller than min_chunk_size
+size_t number_of_chunks(size_t n, size_t min_chunk_size)
+{
+    size_t workers = ThreadPool::instance().num_workers();
+    return std::max((size_t) 1, std::min(workers, n / min_chunk_size));
+}
@@ -0,0 +1,262 @@
+#include <cmath>
+#include <cstdint>
+#include "vector_math.h"
+#if defined(__AVX512F__) || (defined(__AVX2__) && defined(__FMA__))
+#include <immintrin.h>
+#endif
+
+
+/*
+    exp(x):  x = k*ln2 + r, |r| <= ln2/2  ->  exp(x) = 2^k * exp(r)
+             exp(r) by its taylor polynomial up to r^13 (remainder < 2^-58)
+    log(x):  x = 2^e * m, m in [sqrt(2)/2, sqrt(2))  ->  log(x) = e*ln2 + log(m)
+             log(m) = 2*atanh(s), s = (m-1)/(m+1), |s| < 0.172, series up to s^21
+             evaluated as f - (f^2/2 - s*(f^2/2 + R(s))) with f = m-1 (as in fdlibm)
+*/
+
+namespace {
+
+const double LOG2E = 1.4426950408889634;
+const double LN2_HI = 6.93147180369123816490e-01;   // ln2 = LN2_HI + LN2_LO
+const double LN2_LO = 1.90821492927058770002e-10;
+const double EXP_MIN = -708.3964185322641;  // log(DBL_MIN), below: flushed to 0
+const double EXP_MAX = 709.08;              // above: 2^k overflows -> inf
+const double SQRT2 = 1.4142135623730951;
+
+// 1/13!, 1/12!, ..., 1/2!, 1, 1
+const double EXP_COEFFS[] = {
+    1.6059043836821615e-10, 2.0876756987868099e-09, 2.5052108385441720e-08,
+    2.7557319223985893e-07, 2.7557319223985888e-06, 2.4801587301587302e-05,
+    1.9841269841269841e-04, 1.3888888888888889e-03, 8.3333333333333332e-03,
+    4.1666666666666664e-02, 1.6666666666666666e-01, 0.5, 1.0, 1.0 };
+const int NUM_EXP_COEFFS = 14;
+
+// 2/21, 2/19, ..., 2/5, 2/3
+const double LOG_COEFFS[] = {
+    2.0/21, 2.0/19, 2.0/17, 2.0/15, 2.0/13, 2.0/11, 2.0/9, 2.0/7, 2.0/5, 2.0/3 };
+const int NUM_LOG_COEFFS = 10;
+
+
+#if defined(__AVX512F__)
+
+const size_t WIDTH = 8;
+typedef __m512d vec;
+
+inline vec exp_kernel(vec x)
+{
+    vec kd = _mm512_roundscale_pd(_mm512_mul_pd(x, _mm512_set1_pd(LOG2E)),
+        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    vec r = _mm512_fnmadd_pd(kd, _mm512_set1_pd(LN2_HI), x);
+    r = _mm512_fnmadd_pd(kd, _mm512_set1_pd(LN2_LO), r);
+    vec p = _mm512_set1_pd(EXP_COEFFS[0]);
+    for (int i=1; i<NUM_EXP_COEFFS; i++) {
+        p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(EXP_COEFFS[i]));
+    }
+    // scalef also takes care of overflow / gradual underflow
+    vec result = _mm512_scalef_pd(p, kd);
+    result = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, _mm512_set1_pd(EXP_MIN), _CMP_LT_OQ),
+        result, _mm512_setzero_pd());
+    result = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, _mm512_set1_pd(EXP_MAX), _CMP_GT_OQ),
+        result, _mm512_set1_pd(INFINITY));
+    return _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, x, _CMP_UNORD_Q), result, x);
+}
+
+inline vec log_kernel(vec x)
+{
+    // split into exponent and mantissa in [1,2)
+    __m512i bits = _mm512_castpd_si512(x);
+    __m512i exp_bits = _mm512_srli_epi64(bits, 52);
+    vec e = _mm512_sub_pd(_mm512_castsi512_pd(_mm512_or_si512(exp_bits,
+        _mm512_castpd_si512(_mm512_set1_pd(4503599627370496.0)))), _mm512_set1_pd(4503599627370496.0 + 1023));
+    vec m = _mm512_castsi512_pd(_mm512_or_si512(_mm512_and_si512(bits, _mm512_set1_epi64(0x000FFFFFFFFFFFFFLL)),
+        _mm512_set1_epi64(0x3FF0000000000000LL)));
+    // move m into [sqrt(2)/2, sqrt(2))
+    __mmask8 big = _mm512_cmp_pd_mask(m, _mm512_set1_pd(SQRT2), _CMP_GT_OQ);
+    m = _mm512_mask_mul_pd(m, big, m, _mm512_set1_pd(0.5));
+    e = _mm512_mask_add_pd(e, big, e, _mm512_set1_pd(1.0));
+
+    vec f = _mm512_sub_pd(m, _mm512_set1_pd(1.0));
+    vec s = _mm512_div_pd(f, _mm512_add_pd(m, _mm512_set1_pd(1.0)));
+    vec s2 = _mm512_mul_pd(s, s);
+    vec R = _mm512_set1_pd(LOG_COEFFS[0]);
+    for (int i=1; i<NUM_LOG_COEFFS; i++) {
+        R = _mm512_fmadd_pd(R, s2, _mm512_set1_pd(LOG_COEFFS[i]));
+    }
+    R = _mm512_mul_pd(R, s2);
+    vec hfsq = _mm512_mul_pd(_mm512_set1_pd(0.5), _mm512_mul_pd(f, f));
+    vec low = _mm512_fmadd_pd(s, _mm512_add_pd(hfsq, R), _mm512_mul_pd(e, _mm512_set1_pd(LN2_LO)));
+    vec log_m = _mm512_sub_pd(f, _mm512_sub_pd(hfsq, low));
+    vec result = _mm512_fmadd_pd(e, _mm512_set1_pd(LN2_HI), log_m);
+
+    // special values
+    result = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, _mm512_set1_pd(INFINITY), _CMP_EQ_OQ),
+        result, _mm512_set1_pd(INFINITY));
+    result = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, _mm512_setzero_pd(), _CMP_EQ_OQ),
+        result, _mm512_set1_pd(-INFINITY));
+    return _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, _mm512_setzero_pd(), _CMP_NGE_UQ),
+        result, _mm512_set1_pd(NAN));
+}
+
+inline vec load(const double *in) { return _mm512_loadu_pd(in); }
+inline void store(double *out, vec v) { _mm512_storeu_pd(out, v); }
+inline vec sigmoid_kernel(vec x)
+{
+    vec one = _mm512_set1_pd(1.0);
+    return _mm512_div_pd(one, _mm512_add_pd(one, exp_kernel(_mm512_sub_pd(_mm512_setzero_pd(), x))));
+}
+
+#elif defined(__AVX2__) && defined(__FMA__)
+
+const size_t WIDTH = 4;
+typedef __m256d vec;
+
+inline vec exp_kernel(vec x)
+{
+    vec kd = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(LOG2E)),
+        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    vec r = _mm256_fnmadd_pd(kd, _mm256_set1_pd(LN2_HI), x);
+    r = _mm256_fnmadd_pd(kd, _mm256_set1_pd(LN2_LO), r);
+    vec p = _mm256_set1_pd(EXP_COEFFS[0]);
+    for (int i=1; i<NUM_EXP_COEFFS; i++) {
+        p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(EXP_COEFFS[i]));
+    }
+    // 2^k: adding 2^52+2^51 puts k into the low mantissa bits, +1023 is the exponent bias
+    __m256i k_bits = _mm256_castpd_si256(_mm256_add_pd(kd, _mm256_set1_pd(6755399441055744.0 + 1023)));
+    vec pow2k = _mm256_castsi256_pd(_mm256_slli_epi64(k_bits, 52));
+    vec result = _mm256_mul_pd(p, pow2k);
+
+    result = _mm256_blendv_pd(result, _mm256_setzero_pd(), _mm256_cmp_pd(x, _mm256_set1_pd(EXP_MIN), _CMP_LT_OQ));
+    result = _mm256_blendv_pd(result, _mm256_set1_pd(INFINITY), _mm256_cmp_pd(x, _mm256_set1_pd(EXP_MAX), _CMP_GT_OQ));
+    return _mm256_blendv_pd(result, x, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+}
+
+inline vec log_kernel(vec x)
+{
+    // split into exponent and mantissa in [1,2)
+    __m256i bits = _mm256_castpd_si256(x);
+    __m256i exp_bits = _mm256_srli_epi64(bits, 52);
+    vec e = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(exp_bits,
+        _mm256_castpd_si256(_mm256_set1_pd(4503599627370496.0)))), _mm256_set1_pd(4503599627370496.0 + 1023));
+    vec m = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi64x(0x000FFFFFFFFFFFFFLL)),
+        _mm256_set1_epi64x(0x3FF0000000000000LL)));
+    // move m into [sqrt(2)/2, sqrt(2))
+    vec big = _mm256_cmp_pd(m, _mm256_set1_pd(SQRT2), _CMP_GT_OQ);
+    m = _mm256_blendv_pd(m, _mm256_mul_pd(m, _mm256_set1_pd(0.5)), big);
+    e = _mm256_add_pd(e, _mm256_and_pd(big, _mm256_set1_pd(1.0)));
+
+    vec f = _mm256_sub_pd(m, _mm256_set1_pd(1.0));
+    vec s = _mm256_div_pd(f, _mm256_add_pd(m, _mm256_set1_pd(1.0)));
+    vec s2 = _mm256_mul_pd(s, s);
+    vec R = _mm256_set1_pd(LOG_COEFFS[0]);
+    for (int i=1; i<NUM_LOG_COEFFS; i++) {
+        R = _mm256_fmadd_pd(R, s2, _mm256_set1_pd(LOG_COEFFS[i]));
+    }
+    R = _mm256_mul_pd(R, s2);
+    vec hfsq = _mm256_mul_pd(_mm256_set1_pd(0.5), _mm256_mul_pd(f, f));
+    vec low = _mm256_fmadd_pd(s, _mm256_add_pd(hfsq, R), _mm256_mul_pd(e, _mm256_set1_pd(LN2_LO)));
+    vec log_m = _mm256_sub_pd(f, _mm256_sub_pd(hfsq, low));
+    vec result = _mm256_fmadd_pd(e, _mm256_set1_pd(LN2_HI), log_m);
+
+    // special values
+    result = _mm256_blendv_pd(result, _mm256_set1_pd(INFINITY), _mm256_cmp_pd(x, _mm256_set1_pd(INFINITY), _CMP_EQ_OQ));
+    result = _mm256_blendv_pd(result, _mm256_set1_pd(-INFINITY), _mm256_cmp_pd(x, _mm256_setzero_pd(), _CMP_EQ_OQ));
+    return _mm256_blendv_pd(result, _mm256_set1_pd(NAN), _mm256_cmp_pd(x, _mm256_setzero_pd(), _CMP_NGE_UQ));
+}
+
+inline vec load(const double *in) { return _mm256_loadu_pd(in); }
+inline void store(double *out, vec v) { _mm256_storeu_pd(out, v); }
+inline vec sigmoid_kernel(vec x)
+{
+    vec one = _mm256_set1_pd(1.0);
+    return _mm256_div_pd(one, _mm256_add_pd(one, exp_kernel(_mm256_sub_pd(_mm256_setzero_pd(), x))));
+}
+
+#endif
+
+#if defined(__AVX512F__) || (defined(__AVX2__) && defined(__FMA__))
+
+// full vectors, then the tail through a zero-padded buffer (same kernel -> same results)
+template <vec (*kernel)(vec)>
+void apply(const double *in, double *out, size_t n)
+{
+    size_t i = 0;
+    for (; i + WIDTH <= n; i += WIDTH) {
+        store(out + i, kernel(load(in + i)));
+    }
+    if (i < n) {
+        double buffer[WIDTH] = {0};
+        for (size_t j=0; i+j<n; j++) buffer[j] = in[i+j];
+        store(buffer, kernel(load(buffer)));
+        for (size_t j=0; i+j<n; j++) out[i+j] = buffer[j];
+    }
+}
+#define HAVE_VECTOR_MATH
+#endif
+
+// the exact path has to round like the scalar libm calls it replaced (verification
+// logs). With -O3 -ffast-math gcc would turn these loops into libmvec calls
+// (_ZGVdN4v_exp, ...), which don't, so they are kept from vectorizing.
+#if defined(__GNUC__) && !defined(__clang__)
+#define SCALAR_LOOP __attribute__((optimize("no-tree-vectorize")))
+#else
+#define SCALAR_LOOP
+#endif
+
+SCALAR_LOOP void exact_exp(const double *in, double *out, size_t n)
+{
+    for (size_t i=0; i<n; i++) {
+        out[i] = std::exp(in[i]);
+    }
+}
+
+SCALAR_LOOP void exact_log(const double *in, double *out, size_t n)
+{
+    for (size_t i=0; i<n; i++) {
+        out[i] = std::log(in[i]);
+    }
+}
+
+SCALAR_LOOP void exact_sigmoid(const double *in, double *out, size_t n)
+{
+    for (size_t i=0; i<n; i++) {
+        out[i] = 1 / (1 + std::exp(-in[i]));
+    }
+}
+
+} // namespace
+
+
+void vexp(const double *in, double *out, size_t n, bool exact)
+{
+#ifdef HAVE_VECTOR_MATH
+    if (not exact) {
+        apply<exp_kernel>(in, out, n);
+        return;
+    }
+#endif
+    exact_exp(in, out, n);
+}
+
+
+void vlog(const double *in, double *out, size_t n, bool exact)
+{
+#ifdef HAVE_VECTOR_MATH
+    if (not exact) {
+        apply<log_kernel>(in, out, n);
+        return;
+    }
+#endif
+    exact_log(in, out, n);
+}
+
+
+void vsigmoid(const double *in, double *out, size_t n, bool exact)
+{
+#ifdef HAVE_VECTOR_MATH
+    if (not exact) {
+        apply<sigmoid_kernel>(in, out, n);
+        return;
+    }
+#endif
+    exact_sigmoid(in, out, n);
+}
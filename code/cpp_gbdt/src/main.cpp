@@ -11,38 +11,35 @@
 #include "verification.h"
 #include "benchmark.h"
 #include "evaluation.h"
+#include "search.h"
 #include "spdlog/spdlog.h"
 
-extern bool VERIFICATION_MODE;
-
 
 int main(int argc, char** argv)
 {
-    // seed randomness once and for all
+    // seed randomness once and for all (dataset shuffling, seeds of the runs)
     srand(time(NULL));
 
-    // parse flags, currently supporting "--verify", "--bench", "--eval"
+    // parse flags, currently supporting "--verify", "--bench", "--eval", "--search"
     if(argc != 1){
         for(int i = 1; i < argc; i++){
             if ( ! std::strcmp(argv[i], "--verify") ){
                 // go into verification mode
-                VERIFICATION_MODE = true;
                 return Verification::main(argc, argv);
             } else if ( ! std::strcmp(argv[i], "--bench") ){
                 // go into benchmark mode
-                VERIFICATION_MODE = false;
                 return Benchmark::main(argc, argv);
             } else if ( ! std::strcmp(argv[i], "--eval") ){
                 // go into evaluation mode
-                VERIFICATION_MODE = false;
                 return Evaluation::main(argc, argv); 
+            } else if ( ! std::strcmp(argv[i], "--search") ){
+                // go into hyperparameter search mode
+                return Search::main(argc, argv);
             } else {
                 throw std::runtime_error("unkown command line flag encountered");
             } 
         }
-    } else { // no flags given, continue in this file
-        VERIFICATION_MODE = false;
-    }
+    } // no flags given, continue in this file
 
     // Set up logging
     spdlog::set_level(spdlog::level::err);
@@ -66,9 +63,10 @@ int main(int argc, char** argv)
     parameters.push_back(current_params);
 
     // Choose your dataset
-    DataSet *dataset = Parser::get_abalone(parameters, 5000, false);
-    // DataSet *dataset = Parser::get_bcw(parameters, 700, false);
-    // DataSet *dataset = Parser::get_YearPredictionMSD(parameters, 17000, false);
+    std::shared_ptr<DataSet> dataset(Parser::get_abalone(parameters, 5000, false));
+    // std::shared_ptr<DataSet> dataset(Parser::get_bcw(parameters, 700, false));
+    // std::shared_ptr<DataSet> dataset(Parser::get_abalone_sex(parameters, 5000, false)); // multi-class
+    // std::shared_ptr<DataSet> dataset(Parser::get_YearPredictionMSD(parameters, 17000, false));
 
     std::cout << dataset->name << std::endl;
 
@@ -83,21 +81,24 @@ int main(int argc, char** argv)
     for (auto split : cv_inputs) {
         
         if(params.scale_y){
-            split->train.scale_y(params, -1, 1);
+            split->scale_y(params, -1, 1);
         }
 
-        DPEnsemble ensemble = DPEnsemble(&params);
-        ensemble.train(&split->train);
+        // every run has its own random numbers (and mode, log, ...)
+        RunContext context(std::rand());
+        DPEnsemble ensemble = DPEnsemble(&params, &context);
+        ensemble.train(split);
         
         // predict with the test set
-        std::vector<double> y_pred = ensemble.predict(split->test.X);
+        std::vector<double> y_pred = ensemble.predict(split->X(), split->test_indices());
 
         if(params.scale_y) {
-            inverse_scale_y(params, split->train.scaler, y_pred);
+            inverse_scale_y(params, split->scaler, y_pred);
         }
 
         // compute score
-        double score = params.task->compute_score(split->test.y, y_pred);
+        std::vector<double> y_test = split->test_y();
+        double score = params.task->compute_score(y_test, y_pred);
 
         std::cout << score << " " << std::flush;
         scores.push_back(score);
@@ -0,0 +1,208 @@
+#include <numeric>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include "gbdt/thread_pool.h"
+#include "parameters.h"
+#include "search.h"
+#include "utils.h"
+#include "gbdt/statistics.h"
+#include "gbdt/dp_ensemble.h"
+#include "dataset_parser.h"
+#include "data.h"
+#include "spdlog/spdlog.h"
+
+typedef std::chrono::steady_clock::time_point Timer;
+
+// one combination of the searched hyperparameters
+struct SearchConfig {
+    int nb_trees;
+    int max_depth;
+    double learning_rate;
+    double l2_threshold;
+    double privacy_budget;
+    RunningStats scores;    // of the current rung, over the folds
+};
+
+// all combinations of the candidate values
+static std::vector<SearchConfig> grid(const std::vector<int> &nb_trees, const std::vector<int> &max_depth,
+    const std::vector<double> &learning_rate, const std::vector<double> &l2_threshold,
+    const std::vector<double> &privacy_budget)
+{
+    std::vector<SearchConfig> configs;
+    for (auto trees : nb_trees) {
+        for (auto depth : max_depth) {
+            for (auto rate : learning_rate) {
+                for (auto threshold : l2_threshold) {
+                    for (auto budget : privacy_budget) {
+                        configs.push_back({trees, depth, rate, threshold, budget, RunningStats()});
+                    }
+                }
+            }
+        }
+    }
+    return configs;
+}
+
+/*
+    Search
+    - tunes nb_trees, max_depth, learning_rate, l2_threshold and privacy_budget
+      with successive halving: every configuration of the grid (or num_random
+      distinct ones drawn from it) runs a 5-fold cv on a small share of each fold's train rows,
+      only the best 1/eta advance to the next rung with eta times the rows,
+      the last rung trains on all of them
+    - all (config, fold) runs of a rung are tasks on the thread pool
+    - writes every config's score per rung to results/search/xy_search.csv, lower
+      scores are better (RMSE, misclassification rate)
+    - a rung only sees a subset of the train rows (the dataset is shuffled, so
+      a random one), with dp every row costs the same budget, so small rungs
+      are noisier. Keep min_fraction large enough for the noise not to drown
+      the differences between the configs
+*/
+
+int Search::main(int argc, char *argv[])
+{
+    // Set up logging for debugging
+    spdlog::set_level(spdlog::level::err);
+    spdlog::set_pattern("[%H:%M:%S] [%^%5l%$] %v");
+
+    // worker threads shared by runs, trees and features (0 = one per core)
+    ThreadPool::set_num_workers(0);
+
+    std::vector<ModelParams> parameters;
+
+    // --------------------------------------
+    // define the fixed ModelParams here
+    ModelParams current_params;
+    current_params.nb_trees = 10;
+    current_params.leaf_clipping = true;
+    current_params.balance_partition = true;
+    current_params.gradient_filtering = true;
+    current_params.min_samples_split = 2;
+
+    parameters.push_back(current_params);
+    // --------------------------------------
+    // select 1 dataset here
+    std::shared_ptr<DataSet> dataset(Parser::get_abalone(parameters, 5000, false)); // full abalone
+    // std::shared_ptr<DataSet> dataset(Parser::get_adult(parameters, 5000, false));
+    // std::shared_ptr<DataSet> dataset(Parser::get_bcw(parameters, 700, false));
+    // --------------------------------------
+    // candidate values of the searched parameters
+    std::vector<int> nb_trees = {10, 25, 50};
+    std::vector<int> max_depth = {2, 4, 6};
+    std::vector<double> learning_rate = {0.05, 0.1, 0.3};
+    std::vector<double> l2_threshold = {0.1, 0.5, 1.0};
+    std::vector<double> privacy_budget = {1};   // usually given, several values show the trade-off
+    // 0: the full grid, otherwise that many random combinations (distinct)
+    int num_random = 27;
+    // each rung keeps the best 1/eta configs and gives them eta times the rows
+    int eta = 3;
+    // share of the train rows in the first rung, the last one uses all
+    double min_fraction = 1. / 9;
+    // where the output file goes (created if missing)
+    std::string results_dir = "results/search";
+    // --------------------------------------
+
+    std::vector<SearchConfig> configs = grid(nb_trees, max_depth, learning_rate, l2_threshold, privacy_budget);
+    if (num_random > 0 and (size_t) num_random < configs.size()) {
+        // without replacement, a duplicate would waste a slot of every rung
+        std::random_shuffle(configs.begin(), configs.end());
+        configs.resize(num_random);
+    }
+    std::vector<double> fractions = {1};
+    while (fractions.front() / eta >= min_fraction * (1 - 1e-9)) {
+        fractions.insert(fractions.begin(), fractions.front() / eta);
+    }
+
+    std::string outfile_name = fmt::format("{}/{}_search_{}.csv", results_dir, dataset->name, get_time_string());
+    std::ofstream output;
+    open_output_file(output, outfile_name);
+    std::cout << "search (" << configs.size() << " configs, " << fractions.size() << " rungs), writing results to "
+        << outfile_name << std::endl;
+    output << "dataset,rung,train_fraction,nb_trees,max_depth,learning_rate,l2_threshold,privacy_budget,mean,std" << std::endl;
+
+    std::vector<TrainTestSplit *> cv_inputs = create_cross_validation_inputs(dataset, 5);
+
+    Timer time_begin = std::chrono::steady_clock::now();
+    for (size_t rung=0; rung<fractions.size(); rung++) {
+        double fraction = fractions[rung];
+        std::mutex scores_mutex;
+        TaskGroup runs;
+        for (auto &config : configs) {
+            config.scores = RunningStats();
+            for (auto split : cv_inputs) {
+                unsigned seed = std::rand();
+                runs.run([&, split, seed]() {
+                    ModelParams param = parameters[0];
+                    param.nb_trees = config.nb_trees;
+                    param.max_depth = config.max_depth;
+                    param.learning_rate = config.learning_rate;
+                    param.l2_threshold = config.l2_threshold;
+                    param.privacy_budget = config.privacy_budget;
+                    param.use_dp = config.privacy_budget != 0.;
+
+                    TrainTestSplit own_split = *split;
+                    if (param.scale_y) {
+                        own_split.scale_y(param, -1, 1);
+                    }
+                    // the first rows of the (shuffled) train set
+                    std::vector<int> rows = own_split.train_indices();
+                    std::vector<double> y = own_split.train_y();
+                    size_t num_rows = std::max((size_t) param.min_samples_split, (size_t) std::lround(fraction * rows.size()));
+                    rows.resize(std::min(num_rows, rows.size()));
+                    y.resize(rows.size());
+
+                    RunContext context(seed);
+                    DPEnsemble ensemble(&param, &context);
+                    ensemble.train(own_split.X(), rows, y);
+                    std::vector<double> y_pred = ensemble.predict(own_split.X(), own_split.test_indices());
+                    if (param.scale_y) {
+                        inverse_scale_y(param, own_split.scaler, y_pred);
+                    }
+                    std::vector<double> y_test = own_split.test_y();
+                    double score = param.task->compute_score(y_test, y_pred);
+
+                    std::lock_guard<std::mutex> lock(scores_mutex);
+                    config.scores.add(score);
+                });
+            }
+        }
+        runs.wait();
+
+        std::stable_sort(configs.begin(), configs.end(), [](const SearchConfig &a, const SearchConfig &b) {
+            return a.scores.mean() < b.scores.mean();
+        });
+        for (auto &config : configs) {
+            output << fmt::format("{},{},{},{},{},{},{},{},{},{}", dataset->name, rung, fraction, config.nb_trees,
+                config.max_depth, config.learning_rate, config.l2_threshold, config.privacy_budget,
+                config.scores.mean(), config.scores.stdev()) << std::endl;
+        }
+        std::cout << "rung " << rung << " (" << std::setprecision(3) << fraction * 100 << "% of the rows): "
+            << configs.size() << " configs, best " << std::setprecision(9) << configs[0].scores.mean() << std::endl;
+
+        // the best 1/eta advance
+        if (rung + 1 < fractions.size()) {
+            configs.resize(std::max((size_t) 1, configs.size() / eta));
+        }
+    }
+
+    SearchConfig &best = configs[0];
+    std::cout << "best: nb_trees=" << best.nb_trees << " max_depth=" << best.max_depth << " learning_rate="
+        << best.learning_rate << " l2_threshold=" << best.l2_threshold << " privacy_budget=" << best.privacy_budget
+        << " -> " << best.scores.mean() << " +- " << best.scores.ci95_half_width() << std::endl;
+
+    // print elapsed time
+    Timer time_end = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration_cast<std::chrono::milliseconds> (time_end - time_begin).count();
+    std::cout << "done (" << std::fixed << std::setprecision(1) << elapsed/1000 << "s)" << std::endl;
+
+    for (auto split : cv_inputs) {
+        delete split;
+    }
+    output.close();
+    return 0;
+}
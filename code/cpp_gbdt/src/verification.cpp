@@ -2,10 +2,19 @@
 #include <vector>
 #include <iostream>
 #include <iomanip>
+#include <functional>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <unistd.h>
 #include "verification.h"
 #include "parameters.h"
 #include "data.h"
 #include "gbdt/dp_ensemble.h"
+#include "gbdt/model_file.h"
+#include "gbdt/checkpoint.h"
 #include "dataset_parser.h"
 #include "spdlog/spdlog.h"
 
@@ -13,11 +22,121 @@
     Verification:
     runs the model on various (small to medium size) datasets for 
     easy verification of correctness. intermediate values are written to
-    verification_logfile.
+    verification_logs/<dataset>.cpp.log.
+    every fold additionally runs check_fold (no python counterpart needed).
 */
 
-extern size_t cv_fold_index;
-std::ofstream verification_logfile;
+
+// trains a fresh ensemble on the split (deterministically unless verification
+// is turned off, not logged) and predicts its test rows
+static std::vector<double> train_and_predict(ModelParams param, TrainTestSplit *split,
+    bool verification = true, unsigned seed = 0)
+{
+    RunContext context(seed);
+    context.verification = verification;
+    DPEnsemble ensemble(&param, &context);
+    ensemble.train(split);
+    return ensemble.predict(split->X(), split->test_indices());
+}
+
+// cuts a checkpoint file after its first num_rounds records and half of the
+// next one, as if the run crashed while writing that round
+static void cut_checkpoint(const std::string &path, int num_rounds)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::vector<char> file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    size_t pos = sizeof(CheckpointHeader);
+    for (int round=0; round<=num_rounds; round++) {
+        uint64_t size;
+        if (file.size() < pos + sizeof(size)) {
+            throw std::runtime_error("checkpoint has fewer rounds than expected");
+        }
+        memcpy(&size, file.data() + pos, sizeof(size));
+        pos += round < num_rounds ? size + 2 * sizeof(uint64_t) : (size + 2 * sizeof(uint64_t)) / 2;
+    }
+    if (pos > file.size() or truncate(path.c_str(), pos) != 0) {
+        throw std::runtime_error("could not cut checkpoint " + path);
+    }
+}
+
+/*
+    things that have to reproduce the predictions (y_pred) of the ensemble that
+    was just trained bit for bit, and seeded runs that have to reproduce each
+    other. Returns the failed checks.
+*/
+static std::vector<std::string> check_fold(const ModelParams &param, TrainTestSplit *split,
+    DPEnsemble &ensemble, const std::vector<double> &y_pred)
+{
+    std::vector<std::string> failed;
+    auto check = [&](const std::string &name, std::function<bool()> same) {
+        try {
+            if (not same()) {
+                failed.push_back(name);
+            }
+        } catch (const std::exception &e) {
+            failed.push_back(name + " (" + e.what() + ")");
+        }
+    };
+
+    // each tree on a contiguous copy of its rows
+    check("reorder_rows", [&]() {
+        ModelParams reordered = param;
+        reordered.reorder_rows = true;
+        return train_and_predict(reordered, split) == y_pred;
+    });
+
+    // save -> load -> predict, and scoring straight from the mapped file
+    std::string model_path = "verification_logs/check.model";
+    ensemble.save(model_path);
+    check("save/load", [&]() {
+        ModelParams loaded_params = param;
+        RunContext context(0);
+        DPEnsemble loaded(&loaded_params, &context);
+        loaded.load(model_path);
+        return loaded.predict(split->X(), split->test_indices()) == y_pred;
+    });
+    check("mmap", [&]() {
+        VVF rows;
+        for (auto row : split->test_indices()) {
+            std::vector<feature_t> values;
+            for (size_t col=0; col<split->X().num_cols(); col++) {
+                values.push_back(split->X().value(row, col));
+            }
+            rows.push_back(values);
+        }
+        MappedModel model(model_path);
+        return model.predict(rows) == y_pred;
+    });
+    std::remove(model_path.c_str());
+
+    // a run that writes a checkpoint, and one that resumes it after a crash
+    // halfway through
+    std::string checkpoint_path = "verification_logs/check.checkpoint";
+    std::remove(checkpoint_path.c_str());
+    ModelParams checkpointed = param;
+    checkpointed.checkpoint = checkpoint_path;
+    check("checkpoint", [&]() {
+        return train_and_predict(checkpointed, split) == y_pred;
+    });
+    check("checkpoint resume", [&]() {
+        cut_checkpoint(checkpoint_path, param.nb_trees / 2);
+        return train_and_predict(checkpointed, split) == y_pred;
+    });
+    std::remove(checkpoint_path.c_str());
+
+    // with random numbers (the K trees of a round are fitted concurrently) the
+    // same seed has to give the same model, also when resumed
+    check("seeded runs", [&]() {
+        return train_and_predict(param, split, false, 42) == train_and_predict(param, split, false, 42);
+    });
+    check("seeded resume", [&]() {
+        std::vector<double> uninterrupted = train_and_predict(checkpointed, split, false, 42);
+        cut_checkpoint(checkpoint_path, param.nb_trees / 2);
+        return train_and_predict(checkpointed, split, false, 42) == uninterrupted;
+    });
+    std::remove(checkpoint_path.c_str());
+    return failed;
+}
 
 
 int Verification::main(int argc, char *argv[])
@@ -44,60 +163,74 @@ int Verification::main(int argc, char *argv[])
     params.use_dp = true;
 
     parameters.push_back(params);
-    datasets.push_back(Parser::get_abalone(parameters, 300, false));
+    datasets.push_back(Parser::get_abalone(parameters, 300, false, false));
+    // multi-class (K trees per round, each on pb / K). The python implementation
+    // splits the budget differently, so this log has no python counterpart.
+    parameters.push_back(params);
+    datasets.push_back(Parser::get_abalone_sex(parameters, 300, false, false));
     // parameters.push_back(params);
-    // datasets.push_back(Parser::get_adult(parameters, 320, false));
+    // datasets.push_back(Parser::get_adult(parameters, 320, false, false));
     // parameters.push_back(params);
-    // datasets.push_back(Parser::get_abalone(parameters, 300, false)); // full abalone
+    // datasets.push_back(Parser::get_abalone(parameters, 300, false, false)); // full abalone
     // parameters.push_back(params);
-    // datasets.push_back(Parser::get_YearPredictionMSD(parameters, 2000, false)); // small yearMSD
+    // datasets.push_back(Parser::get_YearPredictionMSD(parameters, 2000, false, false)); // small yearMSD
     // --------------------------------------
 
-    // use_dp (in combination with VERIFICATION_MODE, which disables dataset shuffling
-    // in create_cross_val_inputs and rounding at certain places) turns off randomness completely
+    // use_dp (in combination with a verification context and no shuffling of the
+    // dataset, which turns off random sampling and adds rounding at certain places)
+    // turns off randomness completely
     // -> we get completely deterministic runs that are comparable to the python output.
 
     // do verification on all added datasets
+    bool checks_ok = true;
     for(size_t i=0; i<datasets.size(); i++) {
-        srand(0);
-        DataSet *dataset = datasets[i];
+        std::shared_ptr<DataSet> dataset(datasets[i]);
         ModelParams &param = parameters[i];
 
-        // Set up logging for verification
-        verification_logfile.open(fmt::format("verification_logs/{}.cpp.log", dataset->name));
+        // Set up logging for verification, the folds share the context
+        std::ofstream verification_logfile(fmt::format("verification_logs/{}.cpp.log", dataset->name));
+        RunContext context(0);
+        context.verification = true;
+        context.verification_log = &verification_logfile;
         std::cout << dataset->name << std::endl;
 
         // do cross validation, always 5 fold for now
-        std::vector<TrainTestSplit *> cv_inputs = create_cross_validation_inputs(dataset, 5);
-        delete dataset;
-        cv_fold_index = 0;
+        std::vector<TrainTestSplit *> cv_inputs = create_cross_validation_inputs(dataset, 5, false);
 
         for (auto split : cv_inputs) {
 
             if(params.scale_y){
-                split->train.scale_y(param, -1, 1);
+                split->scale_y(param, -1, 1);
             }
 
             // train the model
-            DPEnsemble ensemble = DPEnsemble(&param);
-            ensemble.train(&split->train);
+            DPEnsemble ensemble = DPEnsemble(&param, &context);
+            ensemble.train(split);
             
             // predict with the test set
-            std::vector<double> y_pred = ensemble.predict(split->test.X);
+            std::vector<double> y_pred = ensemble.predict(split->X(), split->test_indices());
+            std::vector<std::string> failed_checks = check_fold(param, split, ensemble, y_pred);
+            for (auto &check : failed_checks) {
+                std::cout << "(" << check << " differs) ";
+            }
+            checks_ok = checks_ok and failed_checks.empty();
 
             if(params.scale_y){
-                inverse_scale_y(param, split->train.scaler, y_pred);
+                inverse_scale_y(param, split->scaler, y_pred);
             }
             
             // compute score
-            double score = param.task->compute_score(split->test.y, y_pred);
+            std::vector<double> y_test = split->test_y();
+            double score = param.task->compute_score(y_test, y_pred);
 
             std::cout << std::setprecision(9) << score << " " << std::flush;
-            cv_fold_index++;
+            context.fold_index++;
             delete split;
         } std::cout << std::endl;
-    
-        verification_logfile.close();
+    }
+    if (not checks_ok) {
+        std::cout << "verification checks failed" << std::endl;
+        return 1;
     }
     return 0;
 }